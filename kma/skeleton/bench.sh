@@ -0,0 +1,84 @@
+#!/bin/sh
+#
+# Runs every allocator against every trace, in competition mode, and
+# writes one line of results per run to a CSV or JSON file.
+#
+# usage: bench.sh "algorithms" "traces" repeats format output
+#
+# CC, CFLAGS, SRCS and MT come from the environment (see make bench).
+
+ALGS=$1
+TRACES=$2
+REPEAT=$3
+FORMAT=$4
+OUT=$5
+
+BIN=./kma_bench
+
+# $1: the trace, sets LINE to the output of one run and WALL to its seconds
+run()
+{
+	START=`date +%s%N`
+	LINE=`${BIN} $1 2>&1`
+	STATUS=$?
+	END=`date +%s%N`
+	WALL=`echo "${START} ${END}" | awk '{ printf "%.6f", ($2 - $1) / 1e9 }'`
+}
+
+# $1: the text before the value, prints the value from LINE
+field()
+{
+	echo "${LINE}" | sed -n "s|^$1 *||p" | head -1
+}
+
+if [ "${FORMAT}" = "json" ]; then
+	echo "[" > ${OUT}
+else
+	echo "allocator,trace,run,status,wall_sec,ops_per_sec,peak_pages,avg_waste_ratio,peak_waste_ratio,pages_requested,pages_freed" > ${OUT}
+fi
+
+FIRST=1
+for alg in ${ALGS}; do
+	FLAGS="-D${alg}"
+	if [ "${alg}" = "KMA_MT" ]; then
+		FLAGS="-DKMA_MT -D${MT} -pthread"
+	fi
+	${CC} ${CFLAGS} -DCOMPETITION ${FLAGS} -o ${BIN} ${SRCS} -lm || exit 1
+
+	for trace in ${TRACES}; do
+		i=1
+		while [ $i -le ${REPEAT} ]; do
+			run ${trace}
+			if [ ${STATUS} -eq 0 ]; then
+				RESULT=PASS
+			else
+				RESULT=FAILED
+			fi
+			OPS=`field "Competition ops/sec:"`
+			PEAK=`field "Competition peak pages:"`
+			AVG=`field "Competition average ratio:"`
+			MAX=`field "Competition peak ratio:"`
+			PAGES=`field "Page Requested/Freed/In Use:"`
+			REQUESTED=`echo "${PAGES}" | awk -F/ '{ print $1 + 0 }'`
+			FREED=`echo "${PAGES}" | awk -F/ '{ print $2 + 0 }'`
+
+			if [ "${FORMAT}" = "json" ]; then
+				if [ ${FIRST} -eq 0 ]; then
+					echo "," >> ${OUT}
+				fi
+				printf '  {"allocator": "%s", "trace": "%s", "run": %d, "status": "%s", "wall_sec": %s, "ops_per_sec": %s, "peak_pages": %s, "avg_waste_ratio": %s, "peak_waste_ratio": %s, "pages_requested": %s, "pages_freed": %s}' \
+					${alg} ${trace} $i ${RESULT} ${WALL} ${OPS:-null} ${PEAK:-null} ${AVG:-null} ${MAX:-null} ${REQUESTED} ${FREED} >> ${OUT}
+			else
+				echo "${alg},${trace},$i,${RESULT},${WALL},${OPS},${PEAK},${AVG},${MAX},${REQUESTED},${FREED}" >> ${OUT}
+			fi
+			FIRST=0
+			echo "${alg} ${trace} run $i: ${RESULT} ${OPS} ops/sec, average ratio ${AVG}"
+			i=`expr $i + 1`
+		done
+	done
+done
+
+if [ "${FORMAT}" = "json" ]; then
+	printf '\n]\n' >> ${OUT}
+fi
+rm -f ${BIN}
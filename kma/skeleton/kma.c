@@ -54,10 +54,21 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#ifdef COMPETITION
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 
 /************Private include**********************************************/
 #include "kpage.h"
 #include "kma.h"
+#include "kma_trace.h"
+#include "kma_latency.h"
+#include "kma_stats.h"
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -66,6 +77,17 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+#define REMOTEFREES 25 // default percentage of frees sent to another thread
+
+/* Every allocator serves requests of any size, those larger than a page
+ * from runs of pages, except the dummy one, which only has single pages
+ */
+#ifdef KMA_DUMMY
+#define ALLOCABLE(size) ((size) <= (PAGESIZE - sizeof(void*)))
+#else
+#define ALLOCABLE(size) TRUE
+#endif
+
 enum REQ_STATE
   {
     FREE,
@@ -78,21 +100,59 @@ typedef struct mem
   void* ptr;
   void* value; // to check correctness
   enum REQ_STATE state;
+  int turn; // records of this request replayed so far (--threads)
 } mem_t;
 
+/* One thread of --threads: the records of a trace it replays, in order */
+typedef struct
+{
+  int thread;
+  trace_t* trace;
+  mem_t* requests;
+  int* records;    // indices into trace, NULL for all of them
+  int n_records;
+  int n_ops;       // blocks allocated, freed or reallocated
+  int* turns;      // turn of every record of trace, NULL if not shared
+  pthread_barrier_t* ready;
+  int lock_waits;
+  double seconds;
+  pthread_t tid;
+} replay_t;
+
 /************Global Variables*********************************************/
 
-static int val = 0;
+static __thread int val = 0;
+
+#ifndef KMA_MT
+static pthread_mutex_t kmaLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// calls that found kmaLock taken
+static __thread int lockWaits = 0;
 
 /************Function Prototypes******************************************/
 void allocate();
 void deallocate();
+void reallocate();
+void allocate_batch();
+void deallocate_batch();
+void keep(mem_t*);
+void record_batch(int, int, int, unsigned long long);
 void fill(char*, int);
+void lock_kma();
+void unlock_kma();
+void check_all_freed();
+void replay_threads(char**, int);
+int record_thread(trace_record_t*);
+void* replay(void*);
 void check(char*, char*, int);
 void usage();
 void error(char*, char*);
 void pass();
 void fail();
+int open_tlb_counter(int);
+void print_classes(kma_stats_t*);
+long long read_counter(int);
 
 /************External Declaration*****************************************/
 
@@ -102,10 +162,20 @@ void fail();
 
 int anyMismatches = 0;
 
-int currentAllocBytes = 0;
+// per thread, only sampled when replaying on one
+__thread int currentAllocBytes = 0;
 
 char *name = NULL;
 
+// time every kma_malloc and kma_free (--latency)
+int measureLatency = 0;
+
+// replay on this many threads (--threads), 0 for the calling thread only
+int numThreads = 0;
+
+// percentage of frees made by another thread than the request (--remote)
+int remotePercent = REMOTEFREES;
+
 int
 main(int argc, char* argv[])
 {
@@ -120,12 +190,23 @@ main(int argc, char* argv[])
   printf("%s: Running in correctness mode\n", name);
 #endif
 
-  int n_req = 0, n_alloc=0, n_dealloc=0;
+  int n_req = 0, n_alloc=0, n_dealloc=0, n_realloc=0;
   kpage_stat_t* stat;
 
 #ifdef COMPETITION
   double ratioSum = 0.0;
+  double ratioPeak = 0.0;
   int ratioCount = 0;
+  int pagesPeak = 0;
+  // waste split by kind, see kma_stats.h
+  double headerSum = 0.0, roundingSum = 0.0, freeSum = 0.0, cacheSum = 0.0;
+  long cachePeak = 0;
+  kma_stats_t statsPeak;
+  memset(&statsPeak, 0, sizeof(statsPeak));
+  struct timespec start, end;
+  int tlbLoads = open_tlb_counter(PERF_COUNT_HW_CACHE_OP_READ);
+  int tlbStores = open_tlb_counter(PERF_COUNT_HW_CACHE_OP_WRITE);
+  long long tlbMisses = -1;
 #endif
 
 #ifndef COMPETITION
@@ -137,57 +218,105 @@ main(int argc, char* argv[])
   fprintf(allocTrace, "0 0 0\n");
 #endif
 
-  if (argc != 2)
+  int first = 1;
+  while (first < argc && strncmp(argv[first], "--", 2) == 0)
+    {
+      if (strcmp(argv[first], "--latency") == 0)
+	{
+	  measureLatency = 1;
+	}
+      else if (strcmp(argv[first], "--threads") == 0 && first + 1 < argc)
+	{
+	  numThreads = atoi(argv[++first]);
+	  if (numThreads < 1 || numThreads > MAXTHREADS)
+	    {
+	      usage();
+	    }
+	}
+      else if (strcmp(argv[first], "--remote") == 0 && first + 1 < argc)
+	{
+	  remotePercent = atoi(argv[++first]);
+	}
+      else
+	{
+	  usage();
+	}
+      first++;
+    }
+  if (first == argc)
     {
       usage();
     }
-
-  FILE* f_test = fopen(argv[1], "r");
-  if (f_test == NULL)
+  if (numThreads == 0 && argc - first > 1)
     {
-      error("unable to open input test file", argv[1]);
+      // one thread per trace
+      numThreads = argc - first;
+    }
+  if (numThreads > 0)
+    {
+      if (argc - first > numThreads)
+	{
+	  usage();
+	}
+      replay_threads(argv + first, argc - first);
+#ifndef COMPETITION
+      fclose(allocTrace);
+#endif
+      check_all_freed();
+      pass();
     }
 
-  // Get the number of requests in the trace file
-  // Allocate some memory...
-  int status = fscanf(f_test, "%d\n", &n_req);
-  if(status != 1)
-    error("Couldn't read number of requests at head of file", "");
+  // Text traces are parsed and binary traces mapped up front, so the
+  // replay below only walks the records.
+  trace_t* trace = load_trace(argv[first]);
+  n_req = trace->n_req;
 
   mem_t* requests = malloc((n_req + 1)*sizeof(mem_t));
   memset(requests, 0, (n_req + 1)*sizeof(mem_t));
 
-  char command[16];
-  int req_id, req_size, index = 1;
+  int req_id, i, index = 1;
 
-  // Parse the lines in the file, and call allocate or
-  // deallocate accordingly.
-  while (fscanf(f_test, "%10s", command) == 1)
-    {
-      if (strcmp(command, "REQUEST") == 0)
-	{
+#ifdef COMPETITION
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  long long loadsBefore = read_counter(tlbLoads);
+  long long storesBefore = read_counter(tlbStores);
+#endif
 
-	  if (fscanf(f_test, "%d %d", &req_id, &req_size) != 2)
-	    error("Not enough arguments to REQUEST", "");
+  if (measureLatency)
+    {
+      latency_start();
+    }
 
-	  assert(req_id >= 0 && req_id < n_req);
+  // Call allocate or deallocate for every record.
+  for (i = 0; i < trace->n_records; i++)
+    {
+      trace_record_t* rec = &trace->records[i];
 
-	  allocate(requests, req_id, req_size);
+      req_id = rec->id;
+      if (rec->op == TRACE_REQUEST)
+	{
+	  allocate(requests, req_id, rec->size);
 	  n_alloc++;
 	}
-      else if (strcmp(command, "FREE") == 0)
+      else if (rec->op == TRACE_REALLOC)
 	{
-	  if (fscanf(f_test, "%d", &req_id) != 1)
-	    error("Not enough arguments to FREE", "");
-
-	  assert(req_id >= 0 && req_id < n_req);
-
-	  deallocate(requests, req_id);
-	  n_dealloc++;
+	  reallocate(requests, req_id, rec->size);
+	  n_realloc++;
+	}
+      else if (rec->op == TRACE_BATCH)
+	{
+	  allocate_batch(requests, req_id, rec->count, rec->size);
+	  n_alloc += rec->count;
+	}
+      else if (rec->op == TRACE_BATCHFREE)
+	{
+	  deallocate_batch(requests, req_id, rec->count);
+	  n_dealloc += rec->count;
 	}
       else
 	{
-	  error("unknown command type:", command);
+	  deallocate(requests, req_id);
+	  n_dealloc++;
 	}
 
       stat = page_stats();
@@ -195,13 +324,33 @@ main(int argc, char* argv[])
 
 
 #ifdef COMPETITION
-      if(req_id < n_req && n_alloc != n_dealloc)
+      if(req_id < n_req && n_alloc != n_dealloc && currentAllocBytes > 0)
 	{
 	  // We can calculate the ratio of wasted to used memory here.
 
 	  int wastedBytes = totalBytes - currentAllocBytes;
-	  ratioSum += ((double) wastedBytes) / currentAllocBytes;
+	  double ratio = ((double) wastedBytes) / currentAllocBytes;
+	  ratioSum += ratio;
 	  ratioCount += 1;
+	  if (ratio > ratioPeak)
+	    {
+	      ratioPeak = ratio;
+	    }
+
+	  kma_stats_t* ks = kma_stats();
+	  headerSum += ((double) ks->header_bytes) / currentAllocBytes;
+	  roundingSum += ((double) ks->rounding_bytes) / currentAllocBytes;
+	  freeSum += ((double) ks->free_bytes) / currentAllocBytes;
+	  cacheSum += ((double) ks->cached_bytes) / currentAllocBytes;
+	  if (ks->cached_bytes > cachePeak)
+	    {
+	      cachePeak = ks->cached_bytes;
+	    }
+	}
+      if (stat->num_in_use > pagesPeak)
+	{
+	  pagesPeak = stat->num_in_use;
+	  memcpy(&statsPeak, kma_stats(), sizeof(kma_stats_t));
 	}
 #endif
 
@@ -212,28 +361,57 @@ main(int argc, char* argv[])
       index += 1;
     }
 
+#ifdef COMPETITION
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  // count whichever of the two counters the system gave us
+  if (loadsBefore != -1)
+    {
+      tlbMisses = read_counter(tlbLoads) - loadsBefore;
+    }
+  if (storesBefore != -1)
+    {
+      tlbMisses = (tlbMisses == -1 ? 0 : tlbMisses)
+	+ read_counter(tlbStores) - storesBefore;
+    }
+#endif
+
 #ifndef COMPETITION
   fclose(allocTrace);
 #endif
 
+  unload_trace(trace);
 
-  stat = page_stats();
-
-  printf("Page Requested/Freed/In Use: %5d/%5d/%5d\n",
-	 stat->num_requested, stat->num_freed, stat->num_in_use);
-
-  if (stat->num_requested != stat->num_freed || stat->num_in_use != 0)
+  if (measureLatency)
     {
-      error("not all pages freed", "");
+      latency_finish(-1);
+      latency_report(stdout, 0);
     }
 
-  if(anyMismatches)
-    {
-      error("there were memory mismatches", "");
-    }
+  check_all_freed();
 
 #ifdef COMPETITION
   printf("Competition average ratio: %f\n", ratioSum / ratioCount);
+  printf("Competition peak ratio: %f\n", ratioPeak);
+  printf("Competition peak pages: %d\n", pagesPeak);
+  printf("Competition waste headers/rounding/free/cache/other: "
+	 "%f %f %f %f %f\n",
+	 headerSum / ratioCount, roundingSum / ratioCount, freeSum / ratioCount,
+	 cacheSum / ratioCount,
+	 (ratioSum - headerSum - roundingSum - freeSum - cacheSum) / ratioCount);
+  printf("Competition page cache: %d round trips saved, %ld pages at peak\n",
+	 kma_stats()->cache_hits, cachePeak / PAGESIZE);
+  print_classes(&statsPeak);
+  printf("Competition ops/sec: %.0f\n", (n_alloc + n_dealloc + n_realloc)
+	 / ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9));
+  printf("Competition page pool: %s\n", page_backing());
+  if (tlbMisses == -1)
+    {
+      printf("Competition dTLB misses: unavailable\n");
+    }
+  else
+    {
+      printf("Competition dTLB misses: %lld\n", tlbMisses);
+    }
 #endif
 
   pass();
@@ -256,10 +434,40 @@ pass()
 
 void
 usage() {
-  printf("Usage: %s traceFile\n", name);
+  printf("Usage: %s [--latency] [--threads n [--remote percent]] "
+	 "traceFile...\n"
+	 "  --threads n with one trace shares it out among n threads, and\n"
+	 "  percent (default %d) of its frees are made by another thread\n"
+	 "  than the request; with several traces each thread replays one\n"
+	 "  of them on its own, and there is one thread per trace by\n"
+	 "  default\n", name, REMOTEFREES);
   exit(0);
 }
 
+void
+check_all_freed()
+{
+  kpage_stat_t* stat;
+
+  // empty slabs and blocks cached in magazines still hold their pages
+  kma_drain();
+
+  stat = page_stats();
+
+  printf("Page Requested/Freed/In Use: %5d/%5d/%5d\n",
+	 stat->num_requested, stat->num_freed, stat->num_in_use);
+
+  if (stat->num_requested != stat->num_freed || stat->num_in_use != 0)
+    {
+      error("not all pages freed", "");
+    }
+
+  if(anyMismatches)
+    {
+      error("there were memory mismatches", "");
+    }
+}
+
 void
 error(char* message, char* arg ) {
   fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
@@ -274,21 +482,43 @@ allocate(mem_t* requests, int req_id, int req_size)
   assert(new->state == FREE);
 
   new->size = req_size;
-  new->ptr = kma_malloc(new->size);
+  if (measureLatency)
+    {
+      unsigned long long start = latency_now();
+      lock_kma();
+      new->ptr = kma_malloc(new->size);
+      unlock_kma();
+      latency_record(LATENCY_MALLOC, new->size, latency_now() - start);
+    }
+  else
+    {
+      lock_kma();
+      new->ptr = kma_malloc(new->size);
+      unlock_kma();
+    }
 
-  // Accept a NULL response in some cases...
-  if(!(((new->ptr != NULL) && (new->size <= (PAGESIZE - sizeof(void*))))
-       || ((new->ptr == NULL) && (new->size > (PAGESIZE - sizeof(void*))))))
+  if((new->ptr == NULL) && ALLOCABLE(new->size))
     {
       error("got NULL from kma_malloc for alloc'able request", "");
     }
 
+  keep(new);
+}
+
+/* Count a block just handed out and, when testing for correctness, fill
+ * it and keep a copy of what it holds
+ */
+void
+keep(mem_t* new)
+{
+  new->state = USED;
   if (new->ptr == NULL)
     {
+      // nothing to free later either
       return;
     }
 
-  currentAllocBytes += req_size;
+  currentAllocBytes += new->size;
 
 #ifndef COMPETITION
   // Only run the actual memory accesses/copies/checks if we're
@@ -306,8 +536,6 @@ allocate(mem_t* requests, int req_id, int req_size)
   check((char*)new->ptr, (char*)new->value, new->size);
 
 #endif
-
-  new->state = USED;
 }
 
 void
@@ -318,6 +546,12 @@ deallocate(mem_t* requests, int req_id)
   assert(cur->state == USED);
   assert(cur->size > 0);
 
+  if (cur->ptr == NULL)
+    {
+      cur->state = FREE;
+      return;
+    }
+
 #ifndef COMPETITION
   // Only run the memory checks if we're testing for correctness.
 
@@ -328,13 +562,186 @@ deallocate(mem_t* requests, int req_id)
   free(cur->value);
 #endif
 
-  kma_free(cur->ptr, cur->size);
+  if (measureLatency)
+    {
+      unsigned long long start = latency_now();
+      lock_kma();
+      kma_free(cur->ptr, cur->size);
+      unlock_kma();
+      latency_record(LATENCY_FREE, cur->size, latency_now() - start);
+    }
+  else
+    {
+      lock_kma();
+      kma_free(cur->ptr, cur->size);
+      unlock_kma();
+    }
 
   currentAllocBytes -= cur->size;
 
   cur->state = FREE;
 }
 
+/* Move a request to a new size. A NULL result is accepted where kma_malloc
+ * may return NULL, and leaves the request as it was.
+ */
+void
+reallocate(mem_t* requests, int req_id, int req_size)
+{
+  mem_t* cur = &requests[req_id];
+  int old_size = (cur->ptr != NULL) ? cur->size : 0;
+  void* ptr;
+
+  assert(cur->state == USED);
+
+#ifndef COMPETITION
+  check((char*)cur->ptr, (char*)cur->value, old_size);
+#endif
+
+  if (measureLatency)
+    {
+      unsigned long long start = latency_now();
+      lock_kma();
+      ptr = kma_realloc(cur->ptr, old_size, req_size);
+      unlock_kma();
+      latency_record(LATENCY_REALLOC, req_size, latency_now() - start);
+    }
+  else
+    {
+      lock_kma();
+      ptr = kma_realloc(cur->ptr, old_size, req_size);
+      unlock_kma();
+    }
+
+  if ((ptr == NULL) && ALLOCABLE(req_size))
+    {
+      error("got NULL from kma_realloc for alloc'able request", "");
+    }
+  if (ptr == NULL)
+    {
+      return;
+    }
+
+  currentAllocBytes += req_size - old_size;
+
+#ifndef COMPETITION
+  // what was kept must be intact, what was added gets new values
+  check((char*)ptr, (char*)cur->value, (old_size < req_size) ? old_size
+	: req_size);
+  cur->value = realloc(cur->value, req_size);
+  assert(cur->value != NULL);
+  if (req_size > old_size)
+    {
+      fill((char*)ptr + old_size, req_size - old_size);
+      bcopy(ptr + old_size, cur->value + old_size, req_size - old_size);
+    }
+#endif
+
+  cur->ptr = ptr;
+  cur->size = req_size;
+}
+
+/* Requests req_id, ..., req_id + count - 1 of one size, in one call */
+void
+allocate_batch(mem_t* requests, int req_id, int count, int req_size)
+{
+  void* ptrs[MAXBATCH];
+  int n, i;
+
+  if (measureLatency)
+    {
+      unsigned long long start = latency_now();
+      lock_kma();
+      n = kma_malloc_batch(req_size, count, ptrs);
+      unlock_kma();
+      record_batch(LATENCY_MALLOC_BATCH, req_size, count,
+		   latency_now() - start);
+    }
+  else
+    {
+      lock_kma();
+      n = kma_malloc_batch(req_size, count, ptrs);
+      unlock_kma();
+    }
+
+  if ((n < count) && ALLOCABLE(req_size))
+    {
+      error("kma_malloc_batch fell short for alloc'able request", "");
+    }
+
+  for (i = 0; i < count; i++)
+    {
+      mem_t* new = &requests[req_id + i];
+
+      assert(new->state == FREE);
+      new->size = req_size;
+      new->ptr = (i < n) ? ptrs[i] : NULL;
+      keep(new);
+    }
+}
+
+/* The requests of a batch, which all still have the size they had */
+void
+deallocate_batch(mem_t* requests, int req_id, int count)
+{
+  void* ptrs[MAXBATCH];
+  int size = requests[req_id].size;
+  int n = 0, i;
+
+  for (i = 0; i < count; i++)
+    {
+      mem_t* cur = &requests[req_id + i];
+
+      assert(cur->state == USED);
+      if (cur->size != size)
+	{
+	  error("batch freed with different sizes", "");
+	}
+      cur->state = FREE;
+      if (cur->ptr == NULL)
+	{
+	  continue;
+	}
+
+#ifndef COMPETITION
+      check((char*)cur->ptr, (char*)cur->value, cur->size);
+      free(cur->value);
+#endif
+
+      ptrs[n++] = cur->ptr;
+      currentAllocBytes -= size;
+    }
+
+  if (measureLatency)
+    {
+      unsigned long long start = latency_now();
+      lock_kma();
+      kma_free_batch(ptrs, size, n);
+      unlock_kma();
+      record_batch(LATENCY_FREE_BATCH, size, count, latency_now() - start);
+    }
+  else
+    {
+      lock_kma();
+      kma_free_batch(ptrs, size, n);
+      unlock_kma();
+    }
+}
+
+/* Every block of a batch takes its share of the time, so that the rows
+ * compare with those of kma_malloc and kma_free
+ */
+void
+record_batch(int op, int size, int count, unsigned long long ticks)
+{
+  int i;
+
+  for (i = 0; i < count; i++)
+    {
+      latency_record(op, size, ticks / count);
+    }
+}
+
 void
 fill(char* ptr, int size)
 {
@@ -361,3 +768,302 @@ check(char* lhs, char* rhs, int size)
 	}
     }
 }
+
+/* Allocators that aren't thread-safe are called under one lock when
+ * replaying on several threads, so contention shows in the latencies.
+ */
+void
+lock_kma()
+{
+#ifndef KMA_MT
+  if (numThreads > 0 && pthread_mutex_trylock(&kmaLock) != 0)
+    {
+      lockWaits++;
+      pthread_mutex_lock(&kmaLock);
+    }
+#endif
+}
+
+void
+unlock_kma()
+{
+#ifndef KMA_MT
+  if (numThreads > 0)
+    {
+      pthread_mutex_unlock(&kmaLock);
+    }
+#endif
+}
+
+/* Share one trace out among the threads, or give each its own trace, and
+ * replay them all at once.
+ */
+void
+replay_threads(char** files, int n_files)
+{
+  replay_t replays[MAXTHREADS];
+  trace_t* traces[MAXTHREADS];
+  int counts[MAXTHREADS];
+  mem_t* shared = NULL;
+  int* turns = NULL;
+  int remote = 0;
+  pthread_barrier_t ready;
+  struct timespec start, end;
+  int t, i;
+
+  for (i = 0; i < n_files; i++)
+    {
+      traces[i] = load_trace(files[i]);
+    }
+  memset(replays, 0, sizeof(replays));
+
+  if (n_files == 1)
+    {
+      trace_t* trace = traces[0];
+      int* seen = calloc(trace->n_req + 1, sizeof(int));
+
+      // a record may only be replayed after the ones before it of the
+      // same request, which can be on another thread
+      shared = calloc(trace->n_req + 1, sizeof(mem_t));
+      turns = malloc(trace->n_records * sizeof(int));
+      assert(seen != NULL && shared != NULL && turns != NULL);
+      memset(counts, 0, sizeof(counts));
+      for (i = 0; i < trace->n_records; i++)
+	{
+	  trace_record_t* rec = &trace->records[i];
+
+	  turns[i] = seen[rec->id]++;
+	  counts[record_thread(rec)]++;
+	  if (record_thread(rec) != rec->id % numThreads)
+	    {
+	      remote++;
+	    }
+	}
+      free(seen);
+
+      for (t = 0; t < numThreads; t++)
+	{
+	  replays[t].records = malloc((counts[t] + 1) * sizeof(int));
+	  assert(replays[t].records != NULL);
+	}
+      for (i = 0; i < trace->n_records; i++)
+	{
+	  replay_t* r = &replays[record_thread(&trace->records[i])];
+
+	  r->records[r->n_records++] = i;
+	}
+    }
+
+  pthread_barrier_init(&ready, NULL, numThreads + 1);
+  for (t = 0; t < numThreads; t++)
+    {
+      replay_t* r = &replays[t];
+
+      r->thread = t;
+      r->trace = traces[t % n_files];
+      r->ready = &ready;
+      if (shared != NULL)
+	{
+	  r->requests = shared;
+	  r->turns = turns;
+	}
+      else
+	{
+	  r->requests = calloc(r->trace->n_req + 1, sizeof(mem_t));
+	  assert(r->requests != NULL);
+	  r->n_records = r->trace->n_records;
+	}
+      if (pthread_create(&r->tid, NULL, replay, r) != 0)
+	{
+	  error("unable to start replay thread", "");
+	}
+    }
+
+  pthread_barrier_wait(&ready);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (t = 0; t < numThreads; t++)
+    {
+      pthread_join(replays[t].tid, NULL);
+    }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  pthread_barrier_destroy(&ready);
+
+  double seconds = (end.tv_sec - start.tv_sec)
+    + (end.tv_nsec - start.tv_nsec) / 1e9;
+  int ops = 0, waits = 0;
+
+  printf("Threads: %d, traces: %d, cross-thread frees: %d\n",
+	 numThreads, n_files, remote);
+  for (t = 0; t < numThreads; t++)
+    {
+      replay_t* r = &replays[t];
+
+      printf("Thread %2d: %9d ops %12.0f ops/sec %9d lock waits\n",
+	     t, r->n_ops, r->n_ops / r->seconds, r->lock_waits);
+      ops += r->n_ops;
+      waits += r->lock_waits;
+      free(r->records);
+      if (shared == NULL)
+	{
+	  free(r->requests);
+	}
+    }
+  printf("All threads: %9d ops %12.0f ops/sec %9d lock waits\n",
+	 ops, ops / seconds, waits);
+  if (measureLatency)
+    {
+      latency_report(stdout, numThreads);
+    }
+
+#ifdef COMPETITION
+  printf("Competition ops/sec: %.0f\n", ops / seconds);
+  printf("Competition peak pages: %d\n", page_stats()->num_peak);
+  printf("Competition lock waits: %f\n", ops > 0 ? (double) waits / ops : 0);
+  printf("Competition page pool: %s\n", page_backing());
+#endif
+
+  free(shared);
+  free(turns);
+  for (i = 0; i < n_files; i++)
+    {
+      unload_trace(traces[i]);
+    }
+}
+
+/* Requests are shared out by id, and a hash of the id picks the frees that
+ * go to the next thread instead. A batch goes by its first id, and so its
+ * requests must only be freed together.
+ */
+int
+record_thread(trace_record_t* rec)
+{
+  int thread = rec->id % numThreads;
+
+  if ((rec->op == TRACE_FREE || rec->op == TRACE_BATCHFREE)
+      && ((unsigned int) rec->id * 2654435761u >> 16) % 100 < remotePercent)
+    {
+      thread = (thread + 1) % numThreads;
+    }
+  return thread;
+}
+
+void*
+replay(void* arg)
+{
+  replay_t* r = arg;
+  struct timespec start, end;
+  int k;
+
+  pthread_barrier_wait(r->ready);
+  if (measureLatency)
+    {
+      latency_start();
+    }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (k = 0; k < r->n_records; k++)
+    {
+      int i = (r->records != NULL) ? r->records[k] : k;
+      trace_record_t* rec = &r->trace->records[i];
+      mem_t* req = &r->requests[rec->id];
+
+      if (r->turns != NULL)
+	{
+	  // every wait is for an earlier record, so it always ends
+	  while (__atomic_load_n(&req->turn, __ATOMIC_ACQUIRE) != r->turns[i])
+	    {
+	      sched_yield();
+	    }
+	}
+      if (rec->op == TRACE_REQUEST)
+	{
+	  allocate(r->requests, rec->id, rec->size);
+	}
+      else if (rec->op == TRACE_REALLOC)
+	{
+	  reallocate(r->requests, rec->id, rec->size);
+	}
+      else if (rec->op == TRACE_BATCH)
+	{
+	  allocate_batch(r->requests, rec->id, rec->count, rec->size);
+	}
+      else if (rec->op == TRACE_BATCHFREE)
+	{
+	  deallocate_batch(r->requests, rec->id, rec->count);
+	}
+      else
+	{
+	  deallocate(r->requests, rec->id);
+	}
+      r->n_ops += rec->count;
+      if (r->turns != NULL)
+	{
+	  __atomic_store_n(&req->turn, r->turns[i] + 1, __ATOMIC_RELEASE);
+	}
+    }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  r->seconds = (end.tv_sec - start.tv_sec)
+    + (end.tv_nsec - start.tv_nsec) / 1e9;
+  r->lock_waits = lockWaits;
+  if (measureLatency)
+    {
+      latency_finish(r->thread);
+    }
+  return NULL;
+}
+
+#ifdef COMPETITION
+/* Count the dTLB misses of op (read or write) in user space, -1 if the
+ * system doesn't let us
+ */
+int
+open_tlb_counter(int op)
+{
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB | (op << 8)
+    | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.inherit = 1;
+
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* The size classes of the allocator when it held the most pages */
+void
+print_classes(kma_stats_t* ks)
+{
+  int i;
+
+  printf("Competition classes at peak: %8s %8s %8s %8s %8s %9s\n",
+	 "size", "live", "free", "pages", "splits", "coalesces");
+  for (i = 0; i < ks->num_classes; i++)
+    {
+      kma_class_stat_t* c = &ks->classes[i];
+
+      if (c->live == 0 && c->free == 0 && c->pages == 0)
+	{
+	  continue;
+	}
+      printf("Competition classes at peak: %8d %8d %8d %8d %8d %9d\n",
+	     c->size, c->live, c->free, c->pages, c->splits, c->coalesces);
+    }
+}
+
+long long
+read_counter(int fd)
+{
+  long long count;
+
+  if (fd == -1 || read(fd, &count, sizeof(count)) != sizeof(count))
+    {
+      return -1;
+    }
+  return count;
+}
+#endif
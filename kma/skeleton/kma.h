@@ -69,6 +69,20 @@
 
 typedef int kma_size_t;
 
+/*  In the thread-safe build (KMA_MT) the allocator selected at compile
+ *  time becomes the backend of the magazine layer in kma_mt.c, which
+ *  provides kma_malloc and kma_free instead.
+ */
+#if defined(KMA_MT) && defined(__KMA_IMPL__)
+#define kma_malloc kma_backend_malloc
+#define kma_free kma_backend_free
+#define kma_resize kma_backend_resize
+#define kma_zeroed kma_backend_zeroed
+#define kma_malloc_batch kma_backend_malloc_batch
+#define kma_free_batch kma_backend_free_batch
+#define kma_drain kma_backend_drain
+#endif
+
 /************Global Variables*********************************************/
 
 /************Function Prototypes******************************************/
@@ -95,6 +109,105 @@ EXTERN void* kma_malloc(kma_size_t size);
  ***********************************************************************/
 EXTERN void kma_free(void*, kma_size_t size);
 
+/***********************************************************************
+ *  Title: Reallocates kernel memory
+ * ---------------------------------------------------------------------
+ *    Purpose: Changes the size of the memory space pointed to by ptr,
+ *             in place if the allocator can, otherwise by moving it.
+ *             The contents up to the smaller of the two sizes are
+ *             kept. A NULL ptr is kma_malloc, a new size of 0 is
+ *             kma_free.
+ *    Input: the pointer to the memory space, its size, the new size
+ *    Output: the memory space, or NULL on failure, which leaves the
+ *            old memory space as it was
+ ***********************************************************************/
+void* kma_realloc(void* ptr, kma_size_t old_size, kma_size_t new_size);
+
+/***********************************************************************
+ *  Title: Allocates zeroed kernel memory
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates n * size bytes set to zero. Memory the
+ *             allocator knows to be zero, such as pages fresh from
+ *             the OS, isn't cleared again.
+ *    Input: the number of elements, the size of an element
+ *    Output: the allocated memory or NULL on failure
+ ***********************************************************************/
+void* kma_calloc(kma_size_t n, kma_size_t size);
+
+/***********************************************************************
+ *  Title: Resizes kernel memory in place
+ * ---------------------------------------------------------------------
+ *    Purpose: Provided by every allocator for kma_realloc: changes
+ *             the size of a memory space without moving it, if it can
+ *    Input: the pointer to the memory space, its size, the new size
+ *    Output: TRUE if the memory space now has the new size, FALSE if
+ *            nothing changed
+ ***********************************************************************/
+EXTERN int kma_resize(void* ptr, kma_size_t old_size, kma_size_t new_size);
+
+/***********************************************************************
+ *  Title: Tells whether kernel memory is zero
+ * ---------------------------------------------------------------------
+ *    Purpose: Provided by every allocator for kma_calloc
+ *    Input: memory just returned by kma_malloc, its size
+ *    Output: TRUE if it is known to be all zero
+ ***********************************************************************/
+EXTERN int kma_zeroed(void* ptr, kma_size_t size);
+
+/***********************************************************************
+ *  Title: Allocates a batch of kernel memory
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates n memory spaces of the same size in one call,
+ *             so that the allocator can look up the size class and
+ *             update its free lists once for many of them
+ *    Input: the size, the number of memory spaces, an array of n
+ *           pointers that receives them
+ *    Output: how many were allocated, the first ones of the array;
+ *            fewer than n on failure
+ ***********************************************************************/
+EXTERN int kma_malloc_batch(kma_size_t size, int n, void** out);
+
+/***********************************************************************
+ *  Title: Frees a batch of kernel memory
+ * ---------------------------------------------------------------------
+ *    Purpose: Frees n memory spaces of the same size in one call.
+ *             Pages that the batch empties are released once at the
+ *             end of it.
+ *    Input: the array of pointers, the size, the number of pointers
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kma_free_batch(void** ptrs, kma_size_t size, int n);
+
+/***********************************************************************
+ *  Title: Drains the allocator
+ * ---------------------------------------------------------------------
+ *    Purpose: Gives back the pages the allocator keeps for requests to
+ *             come, such as empty slabs, so that once everything is
+ *             freed every page is. In the thread-safe build it also
+ *             returns every block cached by the calling thread and by
+ *             the depot to the backend first; other threads flush their
+ *             caches when they exit.
+ *    Input: none
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kma_drain(void);
+
+#ifdef KMA_MT
+/***********************************************************************
+ *  Title: Backend of the thread-safe allocator
+ * ---------------------------------------------------------------------
+ *    Purpose: kma_malloc and kma_free of the allocator selected at
+ *             compile time, only ever called under the backend lock
+ ***********************************************************************/
+void* kma_backend_malloc(kma_size_t size);
+void kma_backend_free(void* ptr, kma_size_t size);
+int kma_backend_resize(void* ptr, kma_size_t old_size, kma_size_t new_size);
+int kma_backend_zeroed(void* ptr, kma_size_t size);
+int kma_backend_malloc_batch(kma_size_t size, int n, void** out);
+void kma_backend_free_batch(void** ptrs, kma_size_t size, int n);
+void kma_backend_drain(void);
+#endif
+
 /************External Declaration*****************************************/
 
 /**************Definition***************************************************/
@@ -43,11 +43,12 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include <stdio.h>
-
 /************Private include**********************************************/
 #include "kpage.h"
 #include "kma.h"
+#include "kma_size.h"
+#include "kma_stats.h"
+#include "kma_cache.h"
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -58,39 +59,124 @@
 
 #define MINBUFFERSIZE 64
 
-#define BITMAPSIZE PAGESIZE/MINBUFFERSIZE
+#define MINSHIFT 6
+
+#define NUMORDERS (NUMSIZES(MINSHIFT) - 1) // 64, ..., PAGESIZE/2 share a page
+
+#define UNITS (PAGESIZE/MINBUFFERSIZE)
+
+#define BUFSIZE(order) (MINBUFFERSIZE << (order))
 
 typedef struct bufferT
 {
     kma_size_t size;
     void* ptr;
-    struct bufferT* next_size;
     struct bufferT* next_buffer;
     struct bufferT* prev_buffer;
     kpage_t* page;
 } buffer_t;
 
+/*
+ * Lives in the first MINBUFFERSIZE bytes of every page that is split into
+ * buddies. The tree has one bit per block of every order, set while that
+ * block is free as a whole: the bits of order k start after the
+ * UNITS >> j bits of every order j < k.
+ */
+typedef struct page_headerT
+{
+    kpage_t* page;
+    struct page_headerT* next_empty; // pages a batch of frees emptied
+    int used; // units handed out, header excluded
+    unsigned char tree[2 * UNITS / 8];
+} page_header_t;
+
+/* Lives on the control page */
+typedef struct free_listT
+{
+    kpage_t* page;
+    int num_pages; // pages in use besides the control page
+    buffer_t* heads[NUMORDERS];
+} free_list_t;
+
+#ifdef BUD_SLOTS
+/*
+ * With BUD_SLOTS requests up to MAXSLOT bytes do not take a buffer of at
+ * least 64 bytes with a header, but a slot of a page cut into slots of one
+ * quarter size class (kma_size.h). Slots have no header, the size passed to
+ * kma_free names the class. The page header has a bit per slot, set while
+ * it is free, and a summary word with a bit per bitmap word that has one
+ * set, so a free slot is two count trailing zeros away. Pages with free
+ * slots are on a list of their class, and a page goes back to kpage as soon
+ * as all its slots are free again.
+ */
+#define MAXSLOT 512
+
+#define NUMSLOTCLASSES NUMQUARTERS(9)
+
+#define SLOTHEADER 128 // sizeof(slot_page_t), keeping slots 16 byte aligned
+
+#define SLOTWORDS (((PAGESIZE - SLOTHEADER) / 16 + 63) / 64)
+
+#define SLOTSTAT(slot_class) (NUMORDERS + 1 + (slot_class))
+
+typedef struct slot_pageT
+{
+    struct slot_pageT* next; // pages of the class with free slots
+    struct slot_pageT* prev;
+    unsigned long long summary;         // bit w set while free[w] is not 0
+    unsigned long long whole;           // bit w set while free[w] is all free
+    unsigned long long free[SLOTWORDS]; // slot s is bit s % 64 of word s / 64
+} slot_page_t;
+
+typedef struct slot_classT
+{
+    kma_size_t size;
+    int per_page;
+    unsigned long long whole; // of a page with every slot free
+    slot_page_t* pages;       // pages with free slots
+} slot_class_t;
+#endif
+
 
 /************Global Variables*********************************************/
-static buffer_t* free_list = NULL;
+static free_list_t* free_list = NULL;
 
-/************Function Prototypes******************************************/
-void free_page_if_possible(kpage_t *page);
-void remove_all_from_free_list(kpage_t* page);
-void remove_anybuf_from_free_list(buffer_t* buf);
+#ifdef BUD_SLOTS
+static slot_class_t slot_classes[NUMSLOTCLASSES];
+
+// the orders, runs of pages, then the slot classes; split pages count in
+// the first order
+static kma_stats_t stats = { NUMORDERS + 1 + NUMSLOTCLASSES };
+#else
+// the orders, then runs of pages; split pages count in the first order
+static kma_stats_t stats = { NUMORDERS + 1 };
+#endif
+static page_cache_t page_cache = { PAGECACHE_LOW, PAGECACHE_HIGH, &stats };
 
+/************Function Prototypes******************************************/
+void free_page_if_possible(page_header_t* header);
 void deinit_free_list(void);
 void init_free_list(void);
-void alloc(buffer_t* buf);
-void dealloc(buffer_t* buf);
-int add_new_page(int flag);
-void set_bitmap(buffer_t* node, int value);
-buffer_t* search_for_buffer(kma_size_t);
-buffer_t* init_buffer(buffer_t* size_header, void* ptr, kpage_t* page);
-void remove_buf_from_free_list(buffer_t* node);
-kma_size_t choose_block_size(kma_size_t);
-buffer_t* split_to_size(kma_size_t, buffer_t*);
-buffer_t* coalesce(buffer_t*);
+int add_new_page(void);
+int tree_index(buffer_t* buf, int order);
+void set_tree(buffer_t* buf, int order, int value);
+int is_tree_free(buffer_t* buf, int order);
+buffer_t* search_for_buffer(int order);
+buffer_t* init_buffer(int order, void* ptr, kpage_t* page);
+void remove_buf_from_free_list(buffer_t* buf, int order);
+int choose_order(kma_size_t);
+buffer_t* split_to_size(int need_order, int order, buffer_t* buf);
+void coalesce(buffer_t* buf, int order);
+#ifdef BUD_SLOTS
+void* slot_malloc(kma_size_t size);
+void slot_free(void* ptr, kma_size_t size);
+int slot_resize(kma_size_t old_size, kma_size_t new_size);
+int slot_malloc_batch(kma_size_t size, int n, void** out);
+void init_slot_classes(void);
+slot_page_t* add_slot_page(slot_class_t* sc);
+void link_slot_page(slot_class_t* sc, slot_page_t* page);
+void unlink_slot_page(slot_class_t* sc, slot_page_t* page);
+#endif
 
 
 /************External Declaration*****************************************/
@@ -100,222 +186,175 @@ buffer_t* coalesce(buffer_t*);
 void*
 kma_malloc(kma_size_t size)
 {
+#ifdef BUD_SLOTS
+    if(size <= MAXSLOT)
+        return slot_malloc(size);
+#endif
     if(free_list == NULL)
         init_free_list();
-    kma_size_t block_size = choose_block_size(size);
-    if(block_size != -1)
+    int order = choose_order(size);
+    if(order == NUMORDERS)
     {
-        buffer_t* buf = search_for_buffer(block_size);
-        if(buf == NULL)
-        {
-            int success;
-            if(block_size == PAGESIZE)
-                success = add_new_page(1);
-            else
-                success = add_new_page(0);
-            if(success == -1)
-                return NULL;
-            buf = search_for_buffer(block_size);
-        }
-        if(block_size != PAGESIZE)
-            alloc(buf);
-        else
-            remove_buf_from_free_list(buf->prev_buffer);
+        // run of whole pages, no header or tree needed
+        free_list->num_pages++;
+        stats.classes[NUMORDERS].pages += NUMPAGES(size);
+        stats_alloc(&stats, NUMORDERS, size, NUMPAGES(size) * PAGESIZE, 0);
+        return cache_get_pages(&page_cache, NUMPAGES(size))->ptr;
+    }
 
-        return buf->ptr;
+    buffer_t* buf = search_for_buffer(order);
+    if(buf == NULL)
+    {
+        if(add_new_page() == -1)
+            return NULL;
+        buf = search_for_buffer(order);
     }
-    return NULL;
+    ((page_header_t*)BASEADDR(buf))->used += 1 << order;
+    stats_alloc(&stats, order, size, BUFSIZE(order), sizeof(buffer_t));
+    return buf->ptr;
+}
+
+/* Smallest order holding size plus its header, NUMORDERS for a run of whole
+ * pages
+ */
+int
+choose_order(kma_size_t size)
+{
+    int order = size_to_class(size + sizeof(buffer_t), MINSHIFT);
+    return (order > NUMORDERS) ? NUMORDERS : order;
 }
 
+/* Lay out a fresh page: the header in the first block, followed by one
+ * free buffer of every order.
+ */
 int
-add_new_page(int flag)
+add_new_page(void)
 {
-    kpage_t* page = get_page();
+    kpage_t* page = cache_get_page(&page_cache);
     if(page == NULL)
         return -1;
-    // iterate through free list headers to find size header for the page
-    free_list->next_buffer->size += 1; //keeps count of number of pages in use
-    buffer_t* size_header =  free_list;
-    while(size_header)
-    {
-        if(size_header->size == PAGESIZE)
-            break;
-        else
-            size_header = size_header->next_size;
-    }
-
-    // init buffer to store bitmap on page
-    memset(page->ptr, 0, PAGESIZE);
-    buffer_t* buf = init_buffer(size_header, page->ptr, page);
-    
-    if(!flag)
-    {
-         kma_size_t block_size = choose_block_size(BITMAPSIZE);
-         if(block_size == -1)
-             printf("WHAT WHY?!?!?!?!\n");
-         buffer_t* bitmap_mem = split_to_size(block_size, buf);
-         alloc(bitmap_mem);
-    }
-     return 0;
+    free_list->num_pages++;
+    stats.classes[0].pages++;
+    stats.header_bytes += MINBUFFERSIZE;
+    page_header_t* header = page->ptr;
+    memset(header, 0, sizeof(page_header_t));
+    header->page = page;
+    int order;
+    for(order = 0; order < NUMORDERS; order++)
+        init_buffer(order, page->ptr + BUFSIZE(order), page);
+    return 0;
 }
 
-void
-alloc(buffer_t* node)
+int
+tree_index(buffer_t* buf, int order)
 {
-    set_bitmap(node, 255);
-    remove_buf_from_free_list(node->prev_buffer);
+    int offset = (void*)buf - BASEADDR(buf);
+    return (2 * UNITS - ((2 * UNITS) >> order)) + (offset >> (MINSHIFT + order));
 }
 
 void
-set_bitmap(buffer_t* node, int value)
+set_tree(buffer_t* buf, int order, int value)
 {
-    int bitmap_index = ((void*)node - node->page->ptr)/MINBUFFERSIZE;
-    int size = node->size/MINBUFFERSIZE;
-    memset((node->page->ptr + sizeof(buffer_t) + bitmap_index), value, size);
+    page_header_t* header = BASEADDR(buf);
+    int bit = tree_index(buf, order);
+    if(value)
+        header->tree[bit / 8] |= 1 << (bit % 8);
+    else
+        header->tree[bit / 8] &= ~(1 << (bit % 8));
 }
 
 int
-is_bitmap_free(buffer_t* node)
+is_tree_free(buffer_t* buf, int order)
 {
-    int bitmap_index = ((void*)node - node->page->ptr)/MINBUFFERSIZE;
-    int size = node->size/MINBUFFERSIZE;
-    char *bitmap = node->page->ptr + sizeof(buffer_t);
-    int i;
-    for(i = bitmap_index; i < (bitmap_index + size); i++)
-    {
-        if(bitmap[i] != 0)
-            return 0;
-    }
-    return 1;
+    page_header_t* header = BASEADDR(buf);
+    int bit = tree_index(buf, order);
+    return (header->tree[bit / 8] >> (bit % 8)) & 1;
 }
 
 void
 deinit_free_list(void)
 {
-    free_page(free_list->page);
+    stats.header_bytes -= PAGESIZE;
+    cache_free_page(&page_cache, free_list->page);
     free_list = NULL;
 }
 
 void
 init_free_list(void)
 {
-    int size = 0;
-    int offset = 0;
     //this is where we should be bringing down the initial control page
-    kpage_t* page = get_page();
-    // first buffer just points to a size list and a page counter
-    buffer_t* top = page->ptr + offset;
-    offset += sizeof(buffer_t);
-    top->next_buffer = page->ptr + offset;
-    top->page = page;
-    top->size = 0;
-    top->ptr = NULL;
-    offset += sizeof(buffer_t);
-    buffer_t* counter = top->next_buffer;
-    counter->size = 0;
-    counter->next_buffer = NULL;
-    counter->next_size = NULL;
-    counter->ptr = NULL;
-    counter->page = page;
-    counter->prev_buffer = top;
-    size = MINBUFFERSIZE;
-    free_list = top;
-    while(size <= PAGESIZE)
-    {
-        top->next_size = page->ptr + offset;
-        offset += sizeof(buffer_t);
-        top->next_size->prev_buffer = top;
-        top = top->next_size;
-        top->next_buffer = NULL;
-        top->size = size;
-        top->page = page;
-        size *= 2;
-        top->ptr = NULL;
-    }
-    top->next_size = NULL;
-}
-
-
-kma_size_t
-choose_block_size(kma_size_t size)
-{
-    int test_size = MINBUFFERSIZE;
-    while(test_size <= PAGESIZE)
-    {
-        if(test_size >= (size + sizeof(buffer_t)))
-            return test_size;
-        test_size *= 2;
-    }
-    return -1;
+    kpage_t* page = cache_get_page(&page_cache);
+    free_list = page->ptr;
+    memset(free_list, 0, sizeof(free_list_t));
+    free_list->page = page;
+    int order;
+    for(order = 0; order < NUMORDERS; order++)
+        stats.classes[order].size = BUFSIZE(order);
+    stats.header_bytes += PAGESIZE;
 }
 
+/* Take the smallest free buffer of at least the given order and split it
+ * down to that order.
+ */
 buffer_t*
-search_for_buffer(kma_size_t size)
+search_for_buffer(int order)
 {
-    buffer_t* top = free_list;
-    while(top != NULL)
+    int k;
+    for(k = order; k < NUMORDERS; k++)
     {
-        if(top->size >= size && top->next_buffer != NULL)
+        buffer_t* buf = free_list->heads[k];
+        if(buf != NULL)
         {
-            if(top->size == size)
-                return top->next_buffer;
-            return split_to_size(size, top->next_buffer);
+            remove_buf_from_free_list(buf, k);
+            return split_to_size(order, k, buf);
         }
-        top = top->next_size;
     }
     return NULL;
 }
 
+/* Halve buf until it has need_order, freeing the right half every time */
 buffer_t*
-split_to_size(kma_size_t need_size, buffer_t* node)
+split_to_size(int need_order, int order, buffer_t* buf)
 {
-    if(node->size ==  need_size)
+    while(order > need_order)
     {
-        // found right size
-        return node;
-    }
-    else
-    {
-        // Node is too big, make children and recur on on left child
-        // (left or right is arbitrary choice)
-
-        // parent's prev buffer is it's size header, the size header's prev buffer
-        // is the next smaller size header
-        buffer_t* parent_size_header = node->prev_buffer;
-        buffer_t* child_size_header = parent_size_header->prev_buffer;
-        void* right_ptr = (node->size/2) + (void*)node;
-        remove_buf_from_free_list(parent_size_header);
-        init_buffer(child_size_header, right_ptr, node->page);
-        buffer_t* l_child = init_buffer(child_size_header, (void*)node, node->page);
-        return split_to_size(need_size, l_child);
+        order--;
+        stats.classes[order].splits++;
+        init_buffer(order, (void*)buf + BUFSIZE(order), buf->page);
     }
+    buf->size = BUFSIZE(order);
+    return buf;
 }
 
+/* Put a free buffer at the head of its free list and mark it in the tree */
 buffer_t*
-init_buffer(buffer_t* size_header, void* ptr, kpage_t* page)
-{
-    buffer_t* child = (buffer_t*)ptr;
-    child->size = size_header->size;
-    child->next_size = NULL;
-    child->ptr = ptr + sizeof(buffer_t);
-    child->page = page;
-    child->next_buffer = size_header->next_buffer;
-    if(size_header->next_buffer)
-        size_header->next_buffer->prev_buffer = child;
-    size_header->next_buffer = child;
-    child->prev_buffer = size_header;
-    return child;
+init_buffer(int order, void* ptr, kpage_t* page)
+{
+    buffer_t* buf = (buffer_t*)ptr;
+    buf->size = BUFSIZE(order);
+    buf->ptr = ptr + sizeof(buffer_t);
+    buf->page = page;
+    buf->prev_buffer = NULL;
+    buf->next_buffer = free_list->heads[order];
+    if(buf->next_buffer)
+        buf->next_buffer->prev_buffer = buf;
+    free_list->heads[order] = buf;
+    set_tree(buf, order, TRUE);
+    stats_blocks(&stats, order, 1, BUFSIZE(order));
+    return buf;
 }
 
-/* We should always allocate the first node on the free list for the size, ie
- * size_header->next_buffer
- */
 void
-remove_buf_from_free_list(buffer_t* size_header)
+remove_buf_from_free_list(buffer_t* buf, int order)
 {
-    if(size_header->next_buffer->next_buffer)
-        size_header->next_buffer->next_buffer->prev_buffer = size_header;
-    size_header->next_buffer = size_header->next_buffer->next_buffer;
+    if(buf->prev_buffer)
+        buf->prev_buffer->next_buffer = buf->next_buffer;
+    else
+        free_list->heads[order] = buf->next_buffer;
+    if(buf->next_buffer)
+        buf->next_buffer->prev_buffer = buf->prev_buffer;
+    set_tree(buf, order, FALSE);
+    stats_blocks(&stats, order, -1, BUFSIZE(order));
 }
 
 
@@ -323,22 +362,34 @@ remove_buf_from_free_list(buffer_t* size_header)
 void
 kma_free(void* ptr, kma_size_t size)
 {
+#ifdef BUD_SLOTS
+    if(size <= MAXSLOT)
+    {
+        slot_free(ptr, size);
+        return;
+    }
+#endif
     buffer_t* buf;
     buf = (buffer_t*)(ptr - sizeof(buffer_t));
+    int order = choose_order(size);
     
-    if(choose_block_size(size) == PAGESIZE)
+    if(order == NUMORDERS)
     {
-        free_list->next_buffer->size--;
-        free_page(buf->page);
+        free_list->num_pages--;
+        stats.classes[NUMORDERS].pages -= NUMPAGES(size);
+        stats_free(&stats, NUMORDERS, size, NUMPAGES(size) * PAGESIZE, 0);
+        cache_free_pages(&page_cache, page_descriptor(ptr));
     }
     else
     {
-        dealloc(buf);
-        buffer_t* new_buf = coalesce(buf);
-        free_page_if_possible(new_buf->page);
+        page_header_t* header = BASEADDR(buf);
+        header->used -= 1 << order;
+        stats_free(&stats, order, size, BUFSIZE(order), sizeof(buffer_t));
+        coalesce(buf, order);
+        free_page_if_possible(header);
     }
     
-    if(free_list->next_buffer->size == 0)
+    if(free_list->num_pages == 0)
     {
         // free list is empty, all pages freed
         deinit_free_list();
@@ -346,112 +397,397 @@ kma_free(void* ptr, kma_size_t size)
    
 }
 
+/* A page with nothing handed out is fully coalesced, so its free buffers
+ * are exactly the ones add_new_page laid out.
+ */
 void
-free_page_if_possible(kpage_t *page)
+free_page_if_possible(page_header_t* header)
 {
-    char *bitmap = page->ptr + sizeof(buffer_t);
-    int i;
-    for(i = 4; i < BITMAPSIZE ; i++)
+    if(header->used != 0)
+        return;
+    int order;
+    for(order = 0; order < NUMORDERS; order++)
+        remove_buf_from_free_list((void*)header + BUFSIZE(order), order);
+    free_list->num_pages--;
+    stats.classes[0].pages--;
+    stats.header_bytes -= MINBUFFERSIZE;
+    cache_free_page(&page_cache, header->page);
+}
+
+/*
+ * While the buddy of a buffer is free as a whole, take it off its free list
+ * and merge. The buddy's page offset differs from ours only in the bit of
+ * our size, and the header block at offset 0 is never free, so nothing
+ * merges into it.
+ */
+void
+coalesce(buffer_t* buf, int order)
+{
+    void* base = BASEADDR(buf);
+    while(order < NUMORDERS - 1)
     {
-        if(bitmap[i] != 0)
-        {
-            return;
-        }
-    
+        int offset = (void*)buf - base;
+        buffer_t* buddy = base + (offset ^ BUFSIZE(order));
+        if(!is_tree_free(buddy, order))
+            break;
+        remove_buf_from_free_list(buddy, order);
+        stats.classes[order].coalesces++;
+        if(buddy < buf)
+            buf = buddy;
+        order++;
     }
-    free_list->next_buffer->size--;
-    remove_all_from_free_list(page);  
-    free_page(page);
+    init_buffer(order, (void*)buf, buf->page);
 }
 
 /*
- * If a buffer and it's buddy are free then take them off of the free list,
- * combine them and add them back onto the free list as a single buffer.
- * If we coalesce a buffer to size == PAGESIZE then free the page.
+ * A buffer grows in place while it is the lower half of its pair and the
+ * upper half is free as a whole, and shrinks by freeing its upper halves.
+ * Runs stay where they are if they need as many pages.
  */
-buffer_t*
-coalesce(buffer_t* buf)
-{
-    if(buf->size == PAGESIZE)
-        return buf;
-    kma_size_t parent_size = buf->size * 2;
-    void* iterator = buf->page->ptr;
-    buffer_t* rightChild;
-    buffer_t* leftChild;
-    buffer_t* new_buf;
-    while(iterator-1 < buf->page->ptr+PAGESIZE)
+int
+kma_resize(void* ptr, kma_size_t old_size, kma_size_t new_size)
+{
+#ifdef BUD_SLOTS
+    if(old_size <= MAXSLOT || new_size <= MAXSLOT)
+        return slot_resize(old_size, new_size);
+#endif
+    int order = choose_order(old_size);
+    int need = choose_order(new_size);
+    if(order == NUMORDERS || need == NUMORDERS)
     {
-        if(iterator == (void *)buf)
-        {   //we know its left child
-            rightChild = (buffer_t*)((void*)buf+buf->size);
-            if(is_bitmap_free(rightChild) && rightChild->size == buf->size)
-            {    
-                remove_anybuf_from_free_list(rightChild);
-                remove_anybuf_from_free_list(buf);
-                new_buf = init_buffer(buf->prev_buffer->next_size, (void *)buf, buf->page);
-                buf = coalesce(new_buf);
-            }
-            return buf;
-        }
-        if(iterator > (void *)buf)
-        {   //we know its right child
-            leftChild = (buffer_t*)((void*)buf-buf->size);
-            if(is_bitmap_free(leftChild) && leftChild->size == buf->size)
-            {
-                remove_anybuf_from_free_list(leftChild);
-                remove_anybuf_from_free_list(buf);
-                new_buf = init_buffer(buf->prev_buffer->next_size, (void *)leftChild, buf->page);
-                buf = coalesce(new_buf);
-            }
-            return buf;
-        }
-        iterator += parent_size;
+        if(order != need || NUMPAGES(old_size) != NUMPAGES(new_size))
+            return FALSE;
+        kma_size_t run = NUMPAGES(old_size) * PAGESIZE;
+        stats_free(&stats, NUMORDERS, old_size, run, 0);
+        stats_alloc(&stats, NUMORDERS, new_size, run, 0);
+        return TRUE;
     }
 
-  return NULL;
+    buffer_t* buf = (buffer_t*)(ptr - sizeof(buffer_t));
+    page_header_t* header = BASEADDR(buf);
+    int offset = (void*)buf - (void*)header;
+    int k;
+    for(k = order; k < need; k++)
+    {
+        if((offset & BUFSIZE(k)) || !is_tree_free((void*)buf + BUFSIZE(k), k))
+            return FALSE;
+    }
+    for(k = order; k < need; k++)
+    {
+        remove_buf_from_free_list((void*)buf + BUFSIZE(k), k);
+        stats.classes[k].coalesces++;
+    }
+    if(need < order)
+        split_to_size(need, order, buf);
+    buf->size = BUFSIZE(need);
+    header->used += (1 << need) - (1 << order);
+    stats_free(&stats, order, old_size, BUFSIZE(order), sizeof(buffer_t));
+    stats_alloc(&stats, need, new_size, BUFSIZE(need), sizeof(buffer_t));
+    return TRUE;
+}
 
-} 
-void remove_anybuf_from_free_list(buffer_t* buf)
+/* Only runs come straight from kpage, buffers have headers */
+int
+kma_zeroed(void* ptr, kma_size_t size)
 {
-    buffer_t* prev = buf->prev_buffer;
-    prev->next_buffer = buf->next_buffer;
-    if(buf->next_buffer)
-        buf->next_buffer->prev_buffer = prev;
+    return choose_order(size) == NUMORDERS && page_descriptor(ptr)->zero;
 }
 
+/*
+ * The order is chosen once and the batch taken from the head of its free
+ * list. When that runs dry and the smallest larger free buffer is no
+ * bigger than what the batch still needs, it is cut up whole: no halves go
+ * through the free lists and the tree just to be taken off again.
+ */
+int
+kma_malloc_batch(kma_size_t size, int n, void** out)
+{
+    if(n <= 0)
+        return 0;
+#ifdef BUD_SLOTS
+    if(size <= MAXSLOT)
+        return slot_malloc_batch(size, n, out);
+#endif
+    if(free_list == NULL)
+        init_free_list();
+    int order = choose_order(size);
+    int i = 0;
+    if(order == NUMORDERS)
+    {
+        for(i = 0; i < n; i++)
+            if((out[i] = kma_malloc(size)) == NULL)
+                break;
+        return i;
+    }
+    while(i < n)
+    {
+        int k = order;
+        while(k < NUMORDERS && free_list->heads[k] == NULL)
+            k++;
+        if(k == NUMORDERS)
+        {
+            if(add_new_page() == -1)
+                break;
+            continue;
+        }
+        buffer_t* buf = free_list->heads[k];
+        remove_buf_from_free_list(buf, k);
+        int pieces = 1 << (k - order);
+        if(pieces > n - i)
+        {
+            buf = split_to_size(order, k, buf);
+            pieces = 1;
+        }
+        else
+        {
+            int j;
+            for(j = order; j < k; j++)
+                stats.classes[j].splits += 1 << (k - 1 - j);
+        }
+        ((page_header_t*)BASEADDR(buf))->used += pieces << order;
+        int j;
+        for(j = 0; j < pieces; j++)
+        {
+            buffer_t* piece = (void*)buf + j * BUFSIZE(order);
+            piece->size = BUFSIZE(order);
+            piece->ptr = (void*)piece + sizeof(buffer_t);
+            piece->page = buf->page;
+            out[i++] = piece->ptr;
+            stats_alloc(&stats, order, size, BUFSIZE(order), sizeof(buffer_t));
+        }
+    }
+    return i;
+}
 
-/* Put buffer back onto free list, reset it's bitmap */
+/*
+ * Buffers coalesce as they are freed, but the pages that end up empty are
+ * chained through their headers and only released, along with the control
+ * page, at the end of the batch.
+ */
 void
-dealloc(buffer_t* buf)
-{
-    buffer_t* size_header = buf->prev_buffer;
-    buf->next_buffer = size_header->next_buffer;
-    if(size_header->next_buffer)
-        size_header->next_buffer->prev_buffer = buf;
-    size_header->next_buffer = buf;
-    buf->prev_buffer = size_header;
-    set_bitmap(buf, 0);
+kma_free_batch(void** ptrs, kma_size_t size, int n)
+{
+    int order = choose_order(size);
+    int i;
+    if(n <= 0)
+        return;
+#ifdef BUD_SLOTS
+    if(size <= MAXSLOT)
+    {
+        for(i = 0; i < n; i++)
+            slot_free(ptrs[i], size);
+        return;
+    }
+#endif
+    if(order == NUMORDERS)
+    {
+        for(i = 0; i < n; i++)
+            kma_free(ptrs[i], size);
+        return;
+    }
+    page_header_t* empty = NULL;
+    for(i = 0; i < n; i++)
+    {
+        buffer_t* buf = (buffer_t*)(ptrs[i] - sizeof(buffer_t));
+        page_header_t* header = BASEADDR(buf);
+        header->used -= 1 << order;
+        stats_free(&stats, order, size, BUFSIZE(order), sizeof(buffer_t));
+        coalesce(buf, order);
+        if(header->used == 0)
+        {
+            header->next_empty = empty;
+            empty = header;
+        }
+    }
+    while(empty != NULL)
+    {
+        page_header_t* header = empty;
+        empty = header->next_empty;
+        free_page_if_possible(header);
+    }
+    if(free_list->num_pages == 0)
+        deinit_free_list();
 }
 
+#ifdef BUD_SLOTS
+void*
+slot_malloc(kma_size_t size)
+{
+    if(slot_classes[0].size == 0)
+        init_slot_classes();
+    int slot_class = size_to_quarter_class(size);
+    slot_class_t* sc = &slot_classes[slot_class];
+    slot_page_t* page = sc->pages;
+    if(page == NULL && (page = add_slot_page(sc)) == NULL)
+        return NULL;
+
+    int w = __builtin_ctzll(page->summary);
+    int s = __builtin_ctzll(page->free[w]);
+    page->free[w] &= page->free[w] - 1;
+    page->whole &= ~(1ULL << w);
+    if(page->free[w] == 0 && (page->summary &= ~(1ULL << w)) == 0)
+        unlink_slot_page(sc, page); // page is full now
+    stats_blocks(&stats, SLOTSTAT(slot_class), -1, sc->size);
+    stats_alloc(&stats, SLOTSTAT(slot_class), size, sc->size, 0);
+    return (void*)page + SLOTHEADER + (64 * w + s) * sc->size;
+}
 
+/*
+ * The word of the slot is all free again when its popcount is the number
+ * of slots it covers, and only then can the whole page be.
+ */
 void
-remove_all_from_free_list(kpage_t* page)
+slot_free(void* ptr, kma_size_t size)
+{
+    int slot_class = size_to_quarter_class(size);
+    slot_class_t* sc = &slot_classes[slot_class];
+    slot_page_t* page = BASEADDR(ptr);
+    int s = (ptr - (void*)page - SLOTHEADER) / sc->size;
+    int w = s / 64;
+    if(page->summary == 0)
+        link_slot_page(sc, page); // page was full
+    page->free[w] |= 1ULL << (s % 64);
+    page->summary |= 1ULL << w;
+    stats_free(&stats, SLOTSTAT(slot_class), size, sc->size, 0);
+    stats_blocks(&stats, SLOTSTAT(slot_class), 1, sc->size);
+
+    int in_word = sc->per_page - 64 * w;
+    if(__builtin_popcountll(page->free[w]) < ((in_word < 64) ? in_word : 64))
+        return;
+    page->whole |= 1ULL << w;
+    if(page->whole != sc->whole)
+        return;
+    unlink_slot_page(sc, page);
+    stats.classes[SLOTSTAT(slot_class)].pages--;
+    stats.header_bytes -= PAGESIZE - sc->per_page * sc->size;
+    stats_blocks(&stats, SLOTSTAT(slot_class), -sc->per_page, sc->size);
+    cache_free_page(&page_cache, page_descriptor(page));
+}
+
+/* Slots stay where they are within their class */
+int
+slot_resize(kma_size_t old_size, kma_size_t new_size)
+{
+    if(old_size > MAXSLOT || new_size > MAXSLOT)
+        return FALSE;
+    int slot_class = size_to_quarter_class(old_size);
+    if(size_to_quarter_class(new_size) != slot_class)
+        return FALSE;
+    kma_size_t slot = slot_classes[slot_class].size;
+    stats_free(&stats, SLOTSTAT(slot_class), old_size, slot, 0);
+    stats_alloc(&stats, SLOTSTAT(slot_class), new_size, slot, 0);
+    return TRUE;
+}
+
+/* A batch takes every free slot of a bitmap word before it looks again */
+int
+slot_malloc_batch(kma_size_t size, int n, void** out)
 {
-    buffer_t* top = free_list->next_size->next_size->next_size; //skip to 256
-    while(top)
+    if(slot_classes[0].size == 0)
+        init_slot_classes();
+    int slot_class = size_to_quarter_class(size);
+    slot_class_t* sc = &slot_classes[slot_class];
+    int i = 0;
+    while(i < n)
     {
-        buffer_t* size_top = top->next_buffer;
-        while(size_top)
+        slot_page_t* page = sc->pages;
+        if(page == NULL && (page = add_slot_page(sc)) == NULL)
+            break;
+        int w = __builtin_ctzll(page->summary);
+        unsigned long long bits = page->free[w];
+        while(bits != 0 && i < n)
         {
-            if(size_top->page == page)
-            {
-               remove_anybuf_from_free_list(size_top);
-               break;
-            }   
-            size_top = size_top->next_buffer;
+            int s = __builtin_ctzll(bits);
+            bits &= bits - 1;
+            out[i++] = (void*)page + SLOTHEADER + (64 * w + s) * sc->size;
+            stats_blocks(&stats, SLOTSTAT(slot_class), -1, sc->size);
+            stats_alloc(&stats, SLOTSTAT(slot_class), size, sc->size, 0);
         }
-        top = top->next_size;
+        page->free[w] = bits;
+        page->whole &= ~(1ULL << w);
+        if(bits == 0 && (page->summary &= ~(1ULL << w)) == 0)
+            unlink_slot_page(sc, page);
     }
+    return i;
+}
+
+void
+init_slot_classes(void)
+{
+    int i;
+    assert(sizeof(slot_page_t) <= SLOTHEADER);
+    for(i = 0; i < NUMSLOTCLASSES; i++)
+    {
+        slot_class_t* sc = &slot_classes[i];
+        sc->size = quarter_class_size(i);
+        sc->per_page = (PAGESIZE - SLOTHEADER) / sc->size;
+        sc->whole = (1ULL << ((sc->per_page + 63) / 64)) - 1;
+        sc->pages = NULL;
+        stats.classes[SLOTSTAT(i)].size = sc->size;
+    }
+}
+
+/* The header and whatever is left after the last slot are the only
+ * overhead of a slot page
+ */
+slot_page_t*
+add_slot_page(slot_class_t* sc)
+{
+    kpage_t* kpage = cache_get_page(&page_cache);
+    if(kpage == NULL)
+        return NULL;
+    slot_page_t* page = kpage->ptr;
+    int w;
+    for(w = 0; w < SLOTWORDS; w++)
+    {
+        int in_word = sc->per_page - 64 * w;
+        if(in_word >= 64)
+            page->free[w] = ~0ULL;
+        else
+            page->free[w] = (in_word > 0) ? (1ULL << in_word) - 1 : 0;
+    }
+    page->summary = sc->whole;
+    page->whole = sc->whole;
+    link_slot_page(sc, page);
+    int slot_class = sc - slot_classes;
+    stats.classes[SLOTSTAT(slot_class)].pages++;
+    stats.header_bytes += PAGESIZE - sc->per_page * sc->size;
+    stats_blocks(&stats, SLOTSTAT(slot_class), sc->per_page, sc->size);
+    return page;
+}
+
+void
+link_slot_page(slot_class_t* sc, slot_page_t* page)
+{
+    page->prev = NULL;
+    page->next = sc->pages;
+    if(sc->pages)
+        sc->pages->prev = page;
+    sc->pages = page;
+}
+
+void
+unlink_slot_page(slot_class_t* sc, slot_page_t* page)
+{
+    if(page->prev)
+        page->prev->next = page->next;
+    else
+        sc->pages = page->next;
+    if(page->next)
+        page->next->prev = page->prev;
+}
+#endif
+
+/* The page cache empties by itself once every page is freed */
+void
+kma_drain(void)
+{
+}
+
+kma_stats_t*
+kma_stats(void)
+{
+    return &stats;
 }
 
 #endif // KMA_BUD
@@ -0,0 +1,153 @@
+/***************************************************************************
+ *  Title: Empty Page Cache
+ * -------------------------------------------------------------------------
+ *    Purpose: Watermarks and decay for the empty pages an allocator
+ *             keeps, see kma_cache.h
+ *    File: kma_cache.c
+ ***************************************************************************/
+
+/************System include***********************************************/
+#include <stddef.h>
+
+/************Private include**********************************************/
+#include "kpage.h"
+#include "kma.h"
+#include "kma_cache.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+void release_cached(page_cache_t*, int);
+void cache_tick(page_cache_t*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+kpage_t*
+cache_get_page(page_cache_t* cache)
+{
+  kpage_t* page = cache->pages;
+
+  if (page == NULL)
+    {
+      page = get_page();
+      if (page == NULL)
+	{
+	  return NULL;
+	}
+    }
+  else
+    {
+      cache->pages = *(kpage_t**) page->ptr;
+      cache->count--;
+      cache->stats->cached_bytes -= PAGESIZE;
+      cache->stats->cache_hits++;
+    }
+  cache->held++;
+  cache_tick(cache);
+  return page;
+}
+
+void
+cache_free_page(page_cache_t* cache, kpage_t* page)
+{
+  if (--cache->held == 0)
+    {
+      // the allocator is empty
+      release_cached(cache, cache->count);
+      free_page(page);
+      return;
+    }
+  if (cache->count >= cache->high)
+    {
+      free_page(page);
+    }
+  else
+    {
+      page->zero = FALSE;
+      *(kpage_t**) page->ptr = cache->pages;
+      cache->pages = page;
+      cache->count++;
+      cache->stats->cached_bytes += PAGESIZE;
+    }
+  cache_tick(cache);
+}
+
+kpage_t*
+cache_get_pages(page_cache_t* cache, int n)
+{
+  if (n == 1)
+    {
+      return cache_get_page(cache);
+    }
+  return get_pages(n);
+}
+
+void
+cache_free_pages(page_cache_t* cache, kpage_t* run)
+{
+  if (run->size == PAGESIZE)
+    {
+      cache_free_page(cache, run);
+    }
+  else
+    {
+      free_pages(run);
+    }
+}
+
+/* Give the least recently cached pages back to kpage */
+void
+release_cached(page_cache_t* cache, int n)
+{
+  kpage_t** link = &cache->pages;
+  int i;
+
+  if (n <= 0)
+    {
+      return;
+    }
+  for (i = 0; i < cache->count - n; i++)
+    {
+      link = (kpage_t**) (*link)->ptr;
+    }
+  while (*link != NULL)
+    {
+      kpage_t* page = *link;
+
+      *link = *(kpage_t**) page->ptr;
+      free_page(page);
+    }
+  cache->count -= n;
+  cache->stats->cached_bytes -= (long) n * PAGESIZE;
+}
+
+/* The pages that were never taken during the last PAGECACHE_DECAY
+ * operations are the ones above the lowest count seen
+ */
+void
+cache_tick(page_cache_t* cache)
+{
+  if (cache->count < cache->min)
+    {
+      cache->min = cache->count;
+    }
+  if (++cache->clock < PAGECACHE_DECAY)
+    {
+      return;
+    }
+  if (cache->min > cache->low)
+    {
+      release_cached(cache, cache->min - cache->low);
+    }
+  cache->clock = 0;
+  cache->min = cache->count;
+}
@@ -0,0 +1,111 @@
+/***************************************************************************
+ *  Title: Empty Page Cache
+ * -------------------------------------------------------------------------
+ *    Purpose: Keeps some of an allocator's empty pages instead of giving
+ *             them back to kpage, so that a page freed and needed again
+ *             soon after costs no round trip
+ *    File: kma_cache.h
+ ***************************************************************************/
+
+#ifndef __KMA_CACHE_H__
+#define __KMA_CACHE_H__
+
+/************System include***********************************************/
+
+/************Private include**********************************************/
+#include "kpage.h"
+#include "kma.h"
+#include "kma_stats.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/*  A cache holds at most high pages. Time is counted in the pages taken
+ *  from and given to the cache; every PAGECACHE_DECAY of them, the pages
+ *  that stayed in the cache all along, beyond the low first ones, go back
+ *  to kpage. When its allocator holds no page at all anymore the cache
+ *  gives all of them back, so an allocator that frees everything frees
+ *  every page.
+ *
+ *  Allocators declare their cache with their own watermarks, e.g.
+ *    static page_cache_t cache = { PAGECACHE_LOW, PAGECACHE_HIGH, &stats };
+ *  and take and give every page and every run through it.
+ */
+#ifndef PAGECACHE_LOW
+#define PAGECACHE_LOW 1
+#endif
+
+#ifndef PAGECACHE_HIGH
+#define PAGECACHE_HIGH 8
+#endif
+
+#ifndef PAGECACHE_DECAY
+#define PAGECACHE_DECAY 64
+#endif
+
+typedef struct
+{
+  int low;            // pages kept however long they go unused
+  int high;           // pages kept at most
+  kma_stats_t* stats; // of the allocator, see cached_bytes
+  int count;          // pages cached
+  int held;           // pages taken from the cache and not given back
+  int min;            // fewest pages cached since the last decay
+  int clock;          // pages taken and given since the last decay
+  kpage_t* pages;     // linked through the first word of each page
+} page_cache_t;
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+
+/***********************************************************************
+ *  Title: Take a page
+ * ---------------------------------------------------------------------
+ *    Purpose: Hand out the most recently cached page, or a page from
+ *             kpage if there is none
+ *    Input: the cache
+ *    Output: the page, NULL if kpage has none left; a cached page is
+ *            not zeroed
+ ***********************************************************************/
+kpage_t* cache_get_page(page_cache_t*);
+
+/***********************************************************************
+ *  Title: Give a page back
+ * ---------------------------------------------------------------------
+ *    Purpose: Keep an empty page while there is room, and give it to
+ *             kpage otherwise
+ *    Input: the cache, a page taken from it
+ *    Output: none
+ ***********************************************************************/
+void cache_free_page(page_cache_t*, kpage_t*);
+
+/***********************************************************************
+ *  Title: Take a run
+ * ---------------------------------------------------------------------
+ *    Purpose: Like get_pages, except that a run of one page is taken
+ *             through the cache
+ *    Input: the cache, the number of pages
+ *    Output: the run, NULL if kpage has none left
+ ***********************************************************************/
+kpage_t* cache_get_pages(page_cache_t*, int);
+
+/***********************************************************************
+ *  Title: Give a run back
+ * ---------------------------------------------------------------------
+ *    Purpose: Like free_pages, except that a run of one page is given
+ *             back through the cache
+ *    Input: the cache, a run taken from it
+ *    Output: none
+ ***********************************************************************/
+void cache_free_pages(page_cache_t*, kpage_t*);
+
+/************External Declaration*****************************************/
+
+/**************Definition***************************************************/
+
+#endif /* __KMA_CACHE_H__ */
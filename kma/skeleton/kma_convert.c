@@ -0,0 +1,53 @@
+/***************************************************************************
+ *  Title: Trace Converter
+ * -------------------------------------------------------------------------
+ *    Purpose: Converts a text trace into the binary trace format
+ *    File: kma_convert.c
+ ***************************************************************************/
+
+/************System include***********************************************/
+#include <stdlib.h>
+#include <stdio.h>
+
+/************Private include**********************************************/
+#include "kma.h"
+#include "kma_trace.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  if (argc != 3)
+    {
+      printf("Usage: %s textTrace binaryTrace\n", argv[0]);
+      exit(1);
+    }
+
+  trace_t* trace = load_trace(argv[1]);
+  write_trace(trace, argv[2]);
+  printf("%s: %d records\n", argv[2], trace->n_records);
+  unload_trace(trace);
+
+  return 0;
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(-1);
+}
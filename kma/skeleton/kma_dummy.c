@@ -54,6 +54,7 @@
 /************Private include**********************************************/
 #include "kpage.h"
 #include "kma.h"
+#include "kma_stats.h"
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -64,6 +65,9 @@
 
 /************Global Variables*********************************************/
 
+// every object is a page of its own, all in one class
+static kma_stats_t stats = { 1, { { PAGESIZE } } };
+
 /************Function Prototypes******************************************/
 
 /************External Declaration*****************************************/
@@ -87,6 +91,9 @@ void* kma_malloc(kma_size_t size)
       return NULL;
     }
 
+  stats.classes[0].pages++;
+  stats_alloc(&stats, 0, size, PAGESIZE, sizeof(kpage_t*));
+
   // check whether the BASEADDR macro works
   //for (i = 0; i < page->size; i++)
   //{
@@ -103,7 +110,70 @@ void kma_free(void* ptr, kma_size_t size)
 
   page = *((kpage_t**)(ptr - sizeof(kpage_t*)));
 
+  stats.classes[0].pages--;
+  stats_free(&stats, 0, size, PAGESIZE, sizeof(kpage_t*));
+
   free_page(page);
 }
 
+int
+kma_resize(void* ptr, kma_size_t old_size, kma_size_t new_size)
+{
+  // the whole page is ours
+  if ((new_size + sizeof(kpage_t*)) > PAGESIZE)
+    {
+      return FALSE;
+    }
+  stats_free(&stats, 0, old_size, PAGESIZE, sizeof(kpage_t*));
+  stats_alloc(&stats, 0, new_size, PAGESIZE, sizeof(kpage_t*));
+  return TRUE;
+}
+
+int
+kma_zeroed(void* ptr, kma_size_t size)
+{
+  // only the page pointer has been written
+  return page_descriptor(ptr)->zero;
+}
+
+/* A page per block, so a batch is that many pages */
+int
+kma_malloc_batch(kma_size_t size, int n, void** out)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    {
+      out[i] = kma_malloc(size);
+      if (out[i] == NULL)
+	{
+	  break;
+	}
+    }
+  return i;
+}
+
+void
+kma_free_batch(void** ptrs, kma_size_t size, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    {
+      kma_free(ptrs[i], size);
+    }
+}
+
+/* Every page goes back as soon as its block is freed */
+void
+kma_drain(void)
+{
+}
+
+kma_stats_t*
+kma_stats(void)
+{
+  return &stats;
+}
+
 #endif // KMA_DUMMY
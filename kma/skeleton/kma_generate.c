@@ -0,0 +1,654 @@
+/***************************************************************************
+ *  Title: Trace Generator
+ * -------------------------------------------------------------------------
+ *    Purpose: Generates text or binary traces of synthetic workloads
+ *    File: kma_generate.c
+ ***************************************************************************/
+
+/************System include***********************************************/
+#include <assert.h>
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/************Private include**********************************************/
+#include "kma.h"
+#include "kma_trace.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/*
+ * Does what testsuite/generate_trace does, in one pass: request i is made
+ * at time i and given the time it is freed at, and the frees that are due
+ * are written before the next request. Live requests wait in a heap ordered
+ * by that time, or in a queue or stack when the frees follow the order of
+ * the requests. Memory is proportional to the live requests, not to the
+ * length of the trace.
+ *
+ * Sizes:
+ *   log, linear  as generate_trace
+ *   zipf         NUMZIPFSIZES sizes picked log-uniformly, the k-th most
+ *                popular requested with probability proportional to 1/k
+ *   bimodal      BIMODALSMALL of the requests at most 8 times min, the
+ *                others at least max/8
+ *   phase        NUMPHASES phases, each log-uniform over its own quarter
+ *                of the log range
+ *
+ * Lifetimes:
+ *   uniform, early  as generate_trace
+ *   fifo            producer/consumer: the oldest request is freed first,
+ *                   while more than a queue depth that changes every
+ *                   FIFODEPTH requests are live
+ *   lifo            a stack: before every request, the newest requests
+ *                   are freed while a coin comes up heads
+ *   longlived       LONGLIVED of the requests live to the end of the
+ *                   trace, the others are freed after an exponentially
+ *                   distributed SHORTLIFE requests on average
+ *
+ * With -r, that percentage of the requests is grown right after it is
+ * made, like a buffer being filled: one to MAXGROWTHS REALLOCs, each to
+ * 1.25 to 2 times the size, up to max.
+ *
+ * With -b, that percentage of the requests is a batch of 2 to MAXGENBATCH
+ * requests of one size and consecutive ids, like the scratch objects of a
+ * single task: made by one BATCH record and freed by one BATCHFREE.
+ */
+
+#define NUMZIPFSIZES 64
+
+#define BIMODALSMALL 0.9
+
+#define NUMPHASES 8
+
+#define EARLY 0.9 // fraction of early frees, as generate_trace
+
+#define FIFODEPTH 1024
+
+#define LONGLIVED 0.1
+
+#define SHORTLIFE 100
+
+#define MAXGROWTHS 3
+
+#define MAXGENBATCH 32
+
+typedef enum
+  {
+    SIZE_LOG,
+    SIZE_LINEAR,
+    SIZE_ZIPF,
+    SIZE_BIMODAL,
+    SIZE_PHASE,
+    NUMSIZEPOLICIES
+  } size_policy_t;
+
+typedef enum
+  {
+    LIFE_UNIFORM,
+    LIFE_EARLY,
+    LIFE_FIFO,
+    LIFE_LIFO,
+    LIFE_LONGLIVED,
+    NUMLIFEPOLICIES
+  } life_policy_t;
+
+typedef struct
+{
+  int due; // time of the free, INT_MAX for the end of the trace
+  int id;
+  int size;
+  int count; // requests of a batch, from id on
+} live_t;
+
+/************Global Variables*********************************************/
+static char* size_names[NUMSIZEPOLICIES] =
+  { "log", "linear", "zipf", "bimodal", "phase" };
+static char* life_names[NUMLIFEPOLICIES] =
+  { "uniform", "early", "fifo", "lifo", "longlived" };
+
+static unsigned long long random_state;
+
+static int count;
+static int min_size, max_size;
+static size_policy_t size_policy;
+static life_policy_t life_policy;
+static int realloc_percent = 0;
+static int batch_percent = 0;
+
+static int zipf_sizes[NUMZIPFSIZES];
+static double zipf_cdf[NUMZIPFSIZES];
+static double phase_low, phase_high; // log2 of the current phase's range
+static int phase = -1;
+
+// the live requests, a heap, a stack or a ring
+static live_t* live;
+static int num_live, live_capacity;
+static int ring_head;
+
+static trace_writer_t* writer;
+static long allocated, max_allocated;
+static int num_reallocs;
+static int num_batches;
+
+/************Function Prototypes******************************************/
+void usage(char*);
+int parse_policy(char*, char**, int);
+void seed_random(unsigned long long);
+unsigned long long next_random(void);
+double random_unit(void);
+int random_between(int, int);
+double log_size(double, double);
+void init_sizes(void);
+int choose_size(int);
+int choose_due(int);
+void emit_request(live_t*);
+void emit_free(live_t*);
+void emit_growth(live_t*);
+void grow_live(int);
+void heap_push(live_t);
+live_t heap_pop(void);
+int before(live_t*, live_t*);
+void generate(void);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  unsigned long long seed = 1;
+  char* out;
+  size_t len;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:r:b:")) != -1)
+    {
+      if (opt == 's')
+	{
+	  seed = strtoull(optarg, NULL, 0);
+	}
+      else if (opt == 'r')
+	{
+	  realloc_percent = atoi(optarg);
+	}
+      else if (opt == 'b')
+	{
+	  batch_percent = atoi(optarg);
+	}
+      else
+	{
+	  usage(argv[0]);
+	}
+    }
+  if (argc - optind != 6)
+    {
+      usage(argv[0]);
+    }
+
+  count = atoi(argv[optind]);
+  size_policy = parse_policy(argv[optind + 1], size_names, NUMSIZEPOLICIES);
+  min_size = atoi(argv[optind + 2]);
+  max_size = atoi(argv[optind + 3]);
+  life_policy = parse_policy(argv[optind + 4], life_names, NUMLIFEPOLICIES);
+  out = argv[optind + 5];
+  if (count < 1 || count > INT_MAX / 2)
+    {
+      error("allocation count out of range", argv[optind]);
+    }
+  if (min_size < 1 || max_size < min_size)
+    {
+      error("invalid request size range", argv[optind + 2]);
+    }
+
+  // binary after the name, like the traces of make traces
+  len = strlen(out);
+  writer = open_trace(out, len > 4 && strcmp(out + len - 4, ".bin") == 0,
+		      2 * count);
+  seed_random(seed);
+  init_sizes();
+  generate();
+  close_trace(writer);
+
+  printf("%d allocations, %d deallocations\n", count, count);
+  if (num_reallocs > 0)
+    {
+      printf("%d reallocations\n", num_reallocs);
+    }
+  if (num_batches > 0)
+    {
+      printf("%d batches\n", num_batches);
+    }
+  printf("Maximum bytes allocated: %ld\n", max_allocated);
+  printf("Seed: %llu\n", seed);
+
+  return 0;
+}
+
+void
+usage(char* name)
+{
+  printf("Usage: %s [-s seed] [-r reallocPercent] [-b batchPercent] "
+	 "allocationCount "
+	 "{log|linear|zipf|bimodal|phase} minRequestSize maxRequestSize "
+	 "{uniform|early|fifo|lifo|longlived} outFile\n"
+	 "outFile is written as a binary trace if it ends in .bin\n", name);
+  exit(1);
+}
+
+int
+parse_policy(char* arg, char** names, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    {
+      if (strcmp(arg, names[i]) == 0)
+	{
+	  return i;
+	}
+    }
+  error("unknown distribution", arg);
+  return -1;
+}
+
+/* xorshift64*, so that a seed gives the same trace everywhere */
+void
+seed_random(unsigned long long seed)
+{
+  // splitmix64 of the seed, which is never 0
+  seed += 0x9e3779b97f4a7c15ULL;
+  seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebULL;
+  random_state = (seed ^ (seed >> 31)) | 1;
+}
+
+unsigned long long
+next_random(void)
+{
+  random_state ^= random_state >> 12;
+  random_state ^= random_state << 25;
+  random_state ^= random_state >> 27;
+  return random_state * 0x2545f4914f6cdd1dULL;
+}
+
+/* In [0, 1) */
+double
+random_unit(void)
+{
+  return (next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* In [low, high] */
+int
+random_between(int low, int high)
+{
+  return low + (int) (random_unit() * ((double) high - low + 1));
+}
+
+/* Log-uniform in [2^low, 2^high) */
+double
+log_size(double low, double high)
+{
+  return pow(2.0, random_unit() * (high - low) + low);
+}
+
+void
+init_sizes(void)
+{
+  double low = log2(min_size);
+  double high = log2(max_size);
+  double total = 0;
+  int i;
+
+  for (i = 0; i < NUMZIPFSIZES; i++)
+    {
+      zipf_sizes[i] = (int) floor(log_size(low, high));
+      total += 1.0 / (i + 1);
+      zipf_cdf[i] = total;
+    }
+  for (i = 0; i < NUMZIPFSIZES; i++)
+    {
+      zipf_cdf[i] /= total;
+    }
+}
+
+int
+choose_size(int i)
+{
+  double low = log2(min_size);
+  double high = log2(max_size);
+  double size = min_size;
+  int lo, hi;
+
+  switch (size_policy)
+    {
+    case SIZE_LOG:
+      size = log_size(low, high);
+      break;
+    case SIZE_LINEAR:
+      size = random_unit() * (max_size - min_size) + min_size;
+      break;
+    case SIZE_ZIPF:
+      {
+	double u = random_unit();
+
+	lo = 0;
+	hi = NUMZIPFSIZES - 1;
+	while (lo < hi)
+	  {
+	    int mid = (lo + hi) / 2;
+
+	    if (zipf_cdf[mid] > u)
+	      {
+		hi = mid;
+	      }
+	    else
+	      {
+		lo = mid + 1;
+	      }
+	  }
+	size = zipf_sizes[lo];
+	break;
+      }
+    case SIZE_BIMODAL:
+      if (random_unit() < BIMODALSMALL)
+	{
+	  size = log_size(low, fmin(low + 3, high));
+	}
+      else
+	{
+	  size = log_size(fmax(high - 3, low), high);
+	}
+      break;
+    case SIZE_PHASE:
+      // a batch may step over the first request of a phase
+      if (i / ((count + NUMPHASES - 1) / NUMPHASES) != phase)
+	{
+	  phase = i / ((count + NUMPHASES - 1) / NUMPHASES);
+	  phase_low = low + random_unit() * (high - low) * 3 / 4;
+	  phase_high = phase_low + (high - low) / 4;
+	}
+      size = log_size(phase_low, phase_high);
+      break;
+    default:
+      assert(0);
+    }
+  return (int) floor(size);
+}
+
+/* Time at which request i is freed, for the policies kept in the heap */
+int
+choose_due(int i)
+{
+  switch (life_policy)
+    {
+    case LIFE_UNIFORM:
+      return i + random_between(1, count - i);
+    case LIFE_EARLY:
+      if (random_unit() < EARLY)
+	{
+	  int early = (count - i) / 10;
+
+	  return i + random_between(1, early < 1 ? 1 : early);
+	}
+      return i + random_between(1, count - i);
+    case LIFE_LONGLIVED:
+      if (random_unit() < LONGLIVED)
+	{
+	  return INT_MAX;
+	}
+      return i + 1 + (int) (-log(1.0 - random_unit()) * SHORTLIFE);
+    default:
+      assert(0);
+    }
+  return INT_MAX;
+}
+
+void
+emit_request(live_t* req)
+{
+  trace_record_t rec = { TRACE_REQUEST, req->id, req->size, req->count };
+
+  if (req->count > 1)
+    {
+      rec.op = TRACE_BATCH;
+      num_batches++;
+    }
+  write_record(writer, &rec);
+  allocated += (long) req->size * req->count;
+  if (allocated > max_allocated)
+    {
+      max_allocated = allocated;
+    }
+}
+
+/* Batches are freed at the size they were made, so only single requests
+ * grow
+ */
+void
+emit_growth(live_t* req)
+{
+  int size = req->size;
+  int n, i;
+
+  // without -r the random numbers, and so the trace, stay as they were
+  if (realloc_percent == 0 || req->count > 1
+      || random_unit() * 100 >= realloc_percent)
+    {
+      return;
+    }
+  n = random_between(1, MAXGROWTHS);
+  for (i = 0; i < n && size < max_size; i++)
+    {
+      int grown = (int) (size * (1.25 + random_unit() * 0.75));
+      trace_record_t rec = { TRACE_REALLOC, req->id, 0, 1 };
+
+      if (grown > max_size)
+	{
+	  grown = max_size;
+	}
+      if (grown <= size)
+	{
+	  grown = size + 1;
+	}
+      rec.size = grown;
+      write_record(writer, &rec);
+      num_reallocs++;
+      allocated += grown - size;
+      if (allocated > max_allocated)
+	{
+	  max_allocated = allocated;
+	}
+      size = grown;
+    }
+  req->size = size;
+}
+
+void
+emit_free(live_t* req)
+{
+  trace_record_t rec = { TRACE_FREE, req->id, 0, req->count };
+
+  if (req->count > 1)
+    {
+      rec.op = TRACE_BATCHFREE;
+    }
+  write_record(writer, &rec);
+  allocated -= (long) req->size * req->count;
+}
+
+void
+grow_live(int n)
+{
+  if (n <= live_capacity)
+    {
+      return;
+    }
+  live_capacity = (live_capacity == 0) ? 1024 : live_capacity * 2;
+  if (live_capacity < n)
+    {
+      live_capacity = n;
+    }
+  live = realloc(live, live_capacity * sizeof(live_t));
+  assert(live != NULL);
+}
+
+/* Earlier due time first, requests due at the same time in request order */
+int
+before(live_t* a, live_t* b)
+{
+  return a->due < b->due || (a->due == b->due && a->id < b->id);
+}
+
+void
+heap_push(live_t req)
+{
+  int i = num_live++;
+
+  grow_live(num_live);
+  while (i > 0 && before(&req, &live[(i - 1) / 2]))
+    {
+      live[i] = live[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+  live[i] = req;
+}
+
+live_t
+heap_pop(void)
+{
+  live_t top = live[0];
+  live_t last = live[--num_live];
+  int i = 0;
+
+  for (;;)
+    {
+      int child = 2 * i + 1;
+
+      if (child >= num_live)
+	{
+	  break;
+	}
+      if (child + 1 < num_live && before(&live[child + 1], &live[child]))
+	{
+	  child++;
+	}
+      if (!before(&live[child], &last))
+	{
+	  break;
+	}
+      live[i] = live[child];
+      i = child;
+    }
+  live[i] = last;
+  return top;
+}
+
+void
+generate(void)
+{
+  int depth = FIFODEPTH;
+  int period = -1;
+  int i;
+
+  if (life_policy == LIFE_FIFO)
+    {
+      grow_live(2 * FIFODEPTH + 1);
+    }
+
+  for (i = 0; i < count; i++)
+    {
+      live_t req = { 0, i, choose_size(i), 1 };
+
+      // without -b the random numbers stay as they were too
+      if (batch_percent > 0 && count - i > 1
+	  && random_unit() * 100 < batch_percent)
+	{
+	  req.count = random_between(2, (count - i < MAXGENBATCH)
+				     ? count - i : MAXGENBATCH);
+	}
+
+      switch (life_policy)
+	{
+	case LIFE_FIFO:
+	  // a ring of the live requests, oldest at ring_head
+	  if (i / FIFODEPTH != period)
+	    {
+	      period = i / FIFODEPTH;
+	      depth = random_between(0, 2 * FIFODEPTH);
+	    }
+	  while (num_live > depth)
+	    {
+	      emit_free(&live[ring_head]);
+	      ring_head = (ring_head + 1) % live_capacity;
+	      num_live--;
+	    }
+	  emit_request(&req);
+	  emit_growth(&req);
+	  live[(ring_head + num_live++) % live_capacity] = req;
+	  break;
+	case LIFE_LIFO:
+	  while (num_live > 0 && (next_random() & 1))
+	    {
+	      emit_free(&live[--num_live]);
+	    }
+	  emit_request(&req);
+	  emit_growth(&req);
+	  grow_live(num_live + 1);
+	  live[num_live++] = req;
+	  break;
+	default:
+	  while (num_live > 0 && live[0].due <= i)
+	    {
+	      live_t due = heap_pop();
+
+	      emit_free(&due);
+	    }
+	  emit_request(&req);
+	  emit_growth(&req);
+	  req.due = choose_due(i);
+	  heap_push(req);
+	  break;
+	}
+      // the other requests of a batch were made with the first
+      i += req.count - 1;
+    }
+
+  // free what is left, in the order of the policy
+  while (num_live > 0)
+    {
+      if (life_policy == LIFE_FIFO)
+	{
+	  emit_free(&live[ring_head]);
+	  ring_head = (ring_head + 1) % live_capacity;
+	  num_live--;
+	}
+      else if (life_policy == LIFE_LIFO)
+	{
+	  emit_free(&live[--num_live]);
+	}
+      else
+	{
+	  live_t due = heap_pop();
+
+	  emit_free(&due);
+	}
+    }
+  free(live);
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(-1);
+}
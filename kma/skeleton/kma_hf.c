@@ -0,0 +1,293 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Kernel memory allocator with header-free blocks in quarter
+ *             power-of-two size classes
+ *    File: kma_hf.c
+ ***************************************************************************/
+#ifdef KMA_HF
+#define __KMA_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+
+/************Private include**********************************************/
+#include "kpage.h"
+#include "kma.h"
+#include "kma_size.h"
+#include "kma_stats.h"
+#include "kma_cache.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/*
+ * Blocks carry no header at all. kma_free is given the size, which names
+ * the class, and BASEADDR of a block is its page, which starts with a
+ * page_t for the rest. Classes go four to a power of two up to a quarter
+ * page (16, 32, 48, 64, 80, ..., PAGESIZE / 4), so requests of 64, 128 or
+ * 256 bytes fill their blocks exactly and no block is more than a quarter
+ * larger than its request. Above that the two classes are the largest
+ * blocks that fit three and two to a page; anything larger is a run of
+ * pages.
+ *
+ * Free blocks of a page are linked through their first word, and blocks
+ * that were never handed out are carved off the end of the used part of the
+ * page, so a new page costs nothing to set up. Pages with free blocks are
+ * on a doubly linked list of their class, which makes both calls O(1).
+ */
+
+#define PAGEHEADER 32 // sizeof(page_t), keeping blocks 16 byte aligned
+
+#define CAPACITY (PAGESIZE - PAGEHEADER)
+
+#define NUMQUARTERCLASSES NUMQUARTERS(PAGESHIFT - 2)
+
+#define NUMCLASSES (NUMQUARTERCLASSES + 2) // and three and two to a page
+
+#define THIRDPAGE ((CAPACITY / 3) & ~15)
+
+#define HALFPAGE ((CAPACITY / 2) & ~15)
+
+typedef struct pageT
+{
+    struct pageT* next; // pages of the class with free blocks
+    struct pageT* prev;
+    void* free;         // freed blocks, linked through their first word
+    short live;         // blocks handed out
+    short fresh;        // offset of the blocks never handed out
+} page_t;
+
+typedef struct size_classT
+{
+    kma_size_t size;
+    int per_page;
+    page_t* pages; // pages with free blocks
+} size_class_t;
+
+/************Global Variables*********************************************/
+static size_class_t classes[NUMCLASSES];
+
+// the block sizes, then runs of pages
+static kma_stats_t stats = { NUMCLASSES + 1 };
+static page_cache_t page_cache = { PAGECACHE_LOW, PAGECACHE_HIGH, &stats };
+
+/************Function Prototypes******************************************/
+int choose_class(kma_size_t);
+void init_classes(void);
+page_t* add_new_page(size_class_t*);
+void link_page(size_class_t*, page_t*);
+void unlink_page(size_class_t*, page_t*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void*
+kma_malloc(kma_size_t size)
+{
+    int size_class = choose_class(size);
+    if(size_class == -1)
+    {
+        stats.classes[NUMCLASSES].pages += NUMPAGES(size);
+        stats_alloc(&stats, NUMCLASSES, size, NUMPAGES(size) * PAGESIZE, 0);
+        return cache_get_pages(&page_cache, NUMPAGES(size))->ptr;
+    }
+    if(classes[0].size == 0)
+        init_classes();
+    size_class_t* sc = &classes[size_class];
+    page_t* header = sc->pages;
+    if(header == NULL && (header = add_new_page(sc)) == NULL)
+        return NULL;
+
+    void* block = header->free;
+    if(block != NULL)
+        header->free = *(void**)block;
+    else
+    {
+        block = (void*)header + header->fresh;
+        header->fresh += sc->size;
+    }
+    if(++header->live == sc->per_page)
+        unlink_page(sc, header); // page is full now
+    stats_blocks(&stats, size_class, -1, sc->size);
+    stats_alloc(&stats, size_class, size, sc->size, 0);
+    return block;
+}
+
+/* Quarter class up to a quarter page, then the third and half page
+ * classes, -1 for a run of pages
+ */
+int
+choose_class(kma_size_t size)
+{
+    if(size <= PAGESIZE / 4)
+        return size_to_quarter_class(size);
+    if(size <= THIRDPAGE)
+        return NUMQUARTERCLASSES;
+    if(size <= HALFPAGE)
+        return NUMQUARTERCLASSES + 1;
+    return -1;
+}
+
+void
+init_classes(void)
+{
+    int i;
+    assert(sizeof(page_t) <= PAGEHEADER);
+    for(i = 0; i < NUMQUARTERCLASSES; i++)
+        classes[i].size = quarter_class_size(i);
+    classes[NUMQUARTERCLASSES].size = THIRDPAGE;
+    classes[NUMQUARTERCLASSES + 1].size = HALFPAGE;
+    for(i = 0; i < NUMCLASSES; i++)
+    {
+        classes[i].per_page = CAPACITY / classes[i].size;
+        classes[i].pages = NULL;
+        stats.classes[i].size = classes[i].size;
+    }
+}
+
+/* The page header and whatever is left after the last block are the only
+ * overhead of a page
+ */
+page_t*
+add_new_page(size_class_t* sc)
+{
+    kpage_t* page = cache_get_page(&page_cache);
+    if(page == NULL)
+        return NULL;
+    page_t* header = page->ptr;
+    header->free = NULL;
+    header->live = 0;
+    header->fresh = PAGEHEADER;
+    link_page(sc, header);
+    int size_class = sc - classes;
+    stats.classes[size_class].pages++;
+    stats.header_bytes += PAGESIZE - sc->per_page * sc->size;
+    stats_blocks(&stats, size_class, sc->per_page, sc->size);
+    return header;
+}
+
+void
+link_page(size_class_t* sc, page_t* header)
+{
+    header->prev = NULL;
+    header->next = sc->pages;
+    if(sc->pages)
+        sc->pages->prev = header;
+    sc->pages = header;
+}
+
+void
+unlink_page(size_class_t* sc, page_t* header)
+{
+    if(header->prev)
+        header->prev->next = header->next;
+    else
+        sc->pages = header->next;
+    if(header->next)
+        header->next->prev = header->prev;
+}
+
+/*
+ * The size gives the class and BASEADDR the page. A page that was full
+ * goes back on its class list, one that is empty now back to kpage.
+ */
+void
+kma_free(void* ptr, kma_size_t size)
+{
+    int size_class = choose_class(size);
+    if(size_class == -1)
+    {
+        stats.classes[NUMCLASSES].pages -= NUMPAGES(size);
+        stats_free(&stats, NUMCLASSES, size, NUMPAGES(size) * PAGESIZE, 0);
+        cache_free_pages(&page_cache, page_descriptor(ptr));
+        return;
+    }
+    size_class_t* sc = &classes[size_class];
+    page_t* header = BASEADDR(ptr);
+    if(header->live == sc->per_page)
+        link_page(sc, header); // page was full
+    *(void**)ptr = header->free;
+    header->free = ptr;
+    stats_free(&stats, size_class, size, sc->size, 0);
+    stats_blocks(&stats, size_class, 1, sc->size);
+    if(--header->live == 0)
+    {
+        unlink_page(sc, header);
+        stats.classes[size_class].pages--;
+        stats.header_bytes -= PAGESIZE - sc->per_page * sc->size;
+        stats_blocks(&stats, size_class, -sc->per_page, sc->size);
+        cache_free_page(&page_cache, page_descriptor(header));
+    }
+}
+
+/* Within a class, or a run of the same number of pages, nothing moves */
+int
+kma_resize(void* ptr, kma_size_t old_size, kma_size_t new_size)
+{
+    int size_class = choose_class(old_size);
+    if(size_class != choose_class(new_size))
+        return FALSE;
+    if(size_class == -1)
+    {
+        if(NUMPAGES(old_size) != NUMPAGES(new_size))
+            return FALSE;
+        kma_size_t run = NUMPAGES(old_size) * PAGESIZE;
+        stats_free(&stats, NUMCLASSES, old_size, run, 0);
+        stats_alloc(&stats, NUMCLASSES, new_size, run, 0);
+        return TRUE;
+    }
+    kma_size_t block = classes[size_class].size;
+    stats_free(&stats, size_class, old_size, block, 0);
+    stats_alloc(&stats, size_class, new_size, block, 0);
+    return TRUE;
+}
+
+/* Only runs come straight from kpage, blocks have held free list links */
+int
+kma_zeroed(void* ptr, kma_size_t size)
+{
+    return choose_class(size) == -1 && page_descriptor(ptr)->zero;
+}
+
+/* One block at a time, each is a pop off its page already */
+int
+kma_malloc_batch(kma_size_t size, int n, void** out)
+{
+    int i;
+    for(i = 0; i < n; i++)
+    {
+        out[i] = kma_malloc(size);
+        if(out[i] == NULL)
+            break;
+    }
+    return i;
+}
+
+void
+kma_free_batch(void** ptrs, kma_size_t size, int n)
+{
+    int i;
+    for(i = 0; i < n; i++)
+        kma_free(ptrs[i], size);
+}
+
+/* The page cache empties by itself once every page is freed */
+void
+kma_drain(void)
+{
+}
+
+kma_stats_t*
+kma_stats(void)
+{
+    return &stats;
+}
+
+#endif // KMA_HF
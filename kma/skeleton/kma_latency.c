@@ -0,0 +1,279 @@
+/***************************************************************************
+ *  Title: Latency Histograms
+ * -------------------------------------------------------------------------
+ *    Purpose: Per operation latency histograms for the test harness
+ *    File: kma_latency.c
+ ***************************************************************************/
+
+/************System include***********************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/************Private include**********************************************/
+#include "kpage.h"
+#include "kma.h"
+#include "kma_size.h"
+#include "kma_latency.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/*
+ * Log-linear buckets: values below SUBBUCKETS have a bucket each, above
+ * that every power of two is split into SUBBUCKETS equal buckets, so a
+ * bucket is never more than 1/SUBBUCKETS (about 6%) wider than its values.
+ * Values of MAXBITS bits and more, half a minute at 2 GHz, all go into the
+ * last bucket; only max tells how large they were.
+ */
+#define SUBBITS 4
+
+#define SUBBUCKETS (1 << SUBBITS)
+
+#define MAXBITS 36
+
+#define NUMBUCKETS ((MAXBITS - SUBBITS + 1) * SUBBUCKETS)
+
+#define MINSHIFT 4
+
+// power-of-two request sizes 16, ..., PAGESIZE, then runs of pages
+#define NUMLATENCYCLASSES (NUMSIZES(MINSHIFT) + 1)
+
+typedef struct
+{
+  unsigned long long count;
+  unsigned long long total;
+  unsigned long long max;
+  unsigned long long buckets[NUMBUCKETS];
+} histogram_t;
+
+/************Global Variables*********************************************/
+// the calling thread's, allocated from latency_start to latency_finish so
+// that threads that don't measure carry none
+static __thread histogram_t (*histograms)[NUMLATENCYCLASSES];
+static __thread unsigned long long start_ticks;
+static __thread struct timespec start_time;
+
+// of every finished thread, and their time in nanoseconds and ticks
+static histogram_t totals[NUMLATENCYOPS][NUMLATENCYCLASSES];
+static histogram_t thread_totals[MAXTHREADS][NUMLATENCYOPS];
+static double total_ns;
+static unsigned long long total_ticks;
+static pthread_mutex_t totals_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char* op_names[NUMLATENCYOPS] =
+  { "malloc", "free", "realloc", "mbatch", "fbatch" };
+
+/************Function Prototypes******************************************/
+int latency_bucket(unsigned long long);
+unsigned long long bucket_limit(int);
+unsigned long long percentile(histogram_t*, double);
+void print_histogram(FILE*, char*, char*, histogram_t*, double);
+void add_histogram(histogram_t*, histogram_t*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void
+latency_start(void)
+{
+  histograms = calloc(NUMLATENCYOPS, sizeof(*histograms));
+  if (histograms == NULL)
+    {
+      error("error: could not allocate the latency histograms", "");
+    }
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+  start_ticks = latency_now();
+}
+
+void
+latency_record(int op, kma_size_t size, unsigned long long ticks)
+{
+  int size_class = size_to_class(size, MINSHIFT);
+  histogram_t* h;
+
+  if (size_class >= NUMLATENCYCLASSES)
+    {
+      size_class = NUMLATENCYCLASSES - 1;
+    }
+  h = &histograms[op][size_class];
+  h->count++;
+  h->total += ticks;
+  if (ticks > h->max)
+    {
+      h->max = ticks;
+    }
+  h->buckets[latency_bucket(ticks)]++;
+}
+
+int
+latency_bucket(unsigned long long ticks)
+{
+  int msb;
+
+  if (ticks < SUBBUCKETS)
+    {
+      return ticks;
+    }
+  if (ticks >> MAXBITS)
+    {
+      return NUMBUCKETS - 1;
+    }
+  msb = 63 - __builtin_clzll(ticks);
+  return (msb - SUBBITS + 1) * SUBBUCKETS
+    + ((ticks >> (msb - SUBBITS)) & (SUBBUCKETS - 1));
+}
+
+/* Largest value that falls into the bucket */
+unsigned long long
+bucket_limit(int bucket)
+{
+  int shift = bucket / SUBBUCKETS - 1;
+
+  if (bucket < SUBBUCKETS)
+    {
+      return bucket;
+    }
+  return ((unsigned long long) (SUBBUCKETS + bucket % SUBBUCKETS + 1)
+	  << shift) - 1;
+}
+
+/* Smallest bucket limit that at least a fraction p of the calls stay within */
+unsigned long long
+percentile(histogram_t* h, double p)
+{
+  unsigned long long rank = (unsigned long long) (p * h->count + 0.5);
+  unsigned long long seen = 0;
+  int i;
+
+  if (rank < 1)
+    {
+      rank = 1;
+    }
+  for (i = 0; i < NUMBUCKETS; i++)
+    {
+      seen += h->buckets[i];
+      if (seen >= rank)
+	{
+	  break;
+	}
+    }
+  if (i >= NUMBUCKETS - 1)
+    {
+      // the last bucket has no limit
+      return h->max;
+    }
+  return (bucket_limit(i) < h->max) ? bucket_limit(i) : h->max;
+}
+
+void
+latency_finish(int thread)
+{
+  struct timespec now;
+  int op, i;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  pthread_mutex_lock(&totals_lock);
+  total_ticks += latency_now() - start_ticks;
+  total_ns += (now.tv_sec - start_time.tv_sec) * 1e9
+    + (now.tv_nsec - start_time.tv_nsec);
+  for (op = 0; op < NUMLATENCYOPS; op++)
+    {
+      for (i = 0; i < NUMLATENCYCLASSES; i++)
+	{
+	  add_histogram(&totals[op][i], &histograms[op][i]);
+	  if (thread >= 0 && thread < MAXTHREADS)
+	    {
+	      add_histogram(&thread_totals[thread][op], &histograms[op][i]);
+	    }
+	}
+    }
+  pthread_mutex_unlock(&totals_lock);
+  free(histograms);
+  histograms = NULL;
+}
+
+void
+add_histogram(histogram_t* to, histogram_t* h)
+{
+  int j;
+
+  to->count += h->count;
+  to->total += h->total;
+  if (h->max > to->max)
+    {
+      to->max = h->max;
+    }
+  for (j = 0; j < NUMBUCKETS; j++)
+    {
+      to->buckets[j] += h->buckets[j];
+    }
+}
+
+void
+latency_report(FILE* out, int num_threads)
+{
+  // ticks per nanosecond over the whole run
+  double scale = (total_ticks > 0) ? total_ns / total_ticks : 1.0;
+  char label[16];
+  int op, i;
+
+  fprintf(out, "Latency (ns)    %10s %8s %8s %8s %8s %10s\n",
+	  "calls", "p50", "p99", "p99.9", "max", "ops/sec");
+  for (op = 0; op < NUMLATENCYOPS; op++)
+    {
+      histogram_t all;
+
+      memset(&all, 0, sizeof(all));
+      for (i = 0; i < NUMLATENCYCLASSES; i++)
+	{
+	  add_histogram(&all, &totals[op][i]);
+	}
+      print_histogram(out, op_names[op], "all", &all, scale);
+
+      for (i = 0; i < NUMLATENCYCLASSES; i++)
+	{
+	  if (i == NUMLATENCYCLASSES - 1)
+	    {
+	      snprintf(label, sizeof(label), ">%d", PAGESIZE);
+	    }
+	  else
+	    {
+	      snprintf(label, sizeof(label), "<=%d", 1 << (MINSHIFT + i));
+	    }
+	  print_histogram(out, op_names[op], label, &totals[op][i], scale);
+	}
+    }
+
+  for (i = 0; i < num_threads && i < MAXTHREADS; i++)
+    {
+      for (op = 0; op < NUMLATENCYOPS; op++)
+	{
+	  snprintf(label, sizeof(label), "t%d", i);
+	  print_histogram(out, op_names[op], label, &thread_totals[i][op],
+			  scale);
+	}
+    }
+}
+
+void
+print_histogram(FILE* out, char* op, char* size, histogram_t* h,
+		double scale)
+{
+  if (h->count == 0)
+    {
+      return;
+    }
+  fprintf(out, "%-7s %-7s %10llu %8.0f %8.0f %8.0f %8.0f %10.0f\n",
+	  op, size, h->count,
+	  percentile(h, 0.5) * scale, percentile(h, 0.99) * scale,
+	  percentile(h, 0.999) * scale, h->max * scale,
+	  h->count / (h->total * scale / 1e9));
+}
@@ -0,0 +1,114 @@
+/***************************************************************************
+ *  Title: Latency Histograms
+ * -------------------------------------------------------------------------
+ *    Purpose: Per operation latency histograms for the test harness
+ *    File: kma_latency.h
+ ***************************************************************************/
+
+#ifndef __KMA_LATENCY_H__
+#define __KMA_LATENCY_H__
+
+/************System include***********************************************/
+#include <stdio.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/************Private include**********************************************/
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#define MAXTHREADS 64 // threads whose latencies are reported one by one
+
+enum LATENCY_OP
+  {
+    LATENCY_MALLOC,
+    LATENCY_FREE,
+    LATENCY_REALLOC,
+    LATENCY_MALLOC_BATCH, // per block, a batch's time over its blocks
+    LATENCY_FREE_BATCH,
+    NUMLATENCYOPS
+  };
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+
+/***********************************************************************
+ *  Title: Current time in ticks
+ * ---------------------------------------------------------------------
+ *    Purpose: Read the time stamp counter where there is one and the
+ *             monotonic clock in nanoseconds otherwise. Ticks are
+ *             converted to nanoseconds when the histograms are
+ *             reported.
+ *    Input: none
+ *    Output: the current tick count
+ ***********************************************************************/
+static inline unsigned long long
+latency_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/***********************************************************************
+ *  Title: Starts measuring latencies
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates the calling thread's histograms and notes the
+ *             time, to convert its ticks to nanoseconds later
+ *    Input: none
+ *    Output: none
+ ***********************************************************************/
+void latency_start(void);
+
+/***********************************************************************
+ *  Title: Records a latency
+ * ---------------------------------------------------------------------
+ *    Purpose: Adds one call to the calling thread's histogram of its
+ *             operation and the size class of its request
+ *    Input: the operation, the request size, the ticks it took
+ *    Output: none
+ ***********************************************************************/
+void latency_record(int op, kma_size_t size, unsigned long long ticks);
+
+/***********************************************************************
+ *  Title: Stops measuring latencies
+ * ---------------------------------------------------------------------
+ *    Purpose: Adds the calling thread's histograms to those reported,
+ *             and keeps its histograms over all sizes as those of
+ *             the given thread, then frees them
+ *    Input: the thread number, -1 when replaying on a single thread
+ *    Output: none
+ ***********************************************************************/
+void latency_finish(int thread);
+
+/***********************************************************************
+ *  Title: Reports the latencies
+ * ---------------------------------------------------------------------
+ *    Purpose: Prints count, p50, p99, p99.9, max and ops/sec for
+ *             every operation, over all sizes and per size class, of
+ *             every finished thread together, then over all sizes
+ *             for each thread
+ *    Input: the output file, the number of threads
+ *    Output: none
+ ***********************************************************************/
+void latency_report(FILE* out, int num_threads);
+
+/************External Declaration*****************************************/
+
+/**************Definition***************************************************/
+
+#endif /* __KMA_LATENCY_H__ */
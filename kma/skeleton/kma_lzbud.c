@@ -42,10 +42,14 @@
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 /************Private include**********************************************/
 #include "kpage.h"
 #include "kma.h"
+#include "kma_size.h"
+#include "kma_stats.h"
+#include "kma_cache.h"
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -54,10 +58,75 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+/*
+ * Buddy blocks of order k are MINBLOCKSIZE << k bytes. The first block of
+ * every page (order HEADERORDER) holds the page header: the kpage_t, the
+ * number of units not globally free and one bit per (order, block) telling
+ * whether that block is globally free. The buddy of a block is found by
+ * flipping the order bit of its page offset.
+ *
+ * Following SVR4, a freed block is only "locally free" (still marked used in
+ * the bitmap, so it never coalesces) while its class has slack, where
+ * slack = allocated - locally free. At slack 1 a free is made global and
+ * coalesced; at slack 0 one more locally free block is made global too. The
+ * slack can't go negative, so every block is global again once all blocks
+ * of a class are freed.
+ *
+ * Requests that don't fit the largest order get a run of whole pages, which
+ * is given back through page_descriptor.
+ */
+
+#define MINBLOCKSIZE 32
+
+#define MINSHIFT 5
+
+#define NUMORDERS (NUMSIZES(MINSHIFT) - 1) // 32, ..., PAGESIZE/2
+
+#define HEADERORDER 2
+
+#define UNITS (PAGESIZE / MINBLOCKSIZE)
+
+#define BLOCKSIZE(order) (MINBLOCKSIZE << (order))
+
+typedef struct blockT
+{
+    struct blockT* next;
+    struct blockT* prev;
+} block_t;
+
+typedef struct page_headerT
+{
+    kpage_t* page;
+    int used; // units not globally free, header excluded
+    unsigned char free_map[2 * UNITS / 8];
+} page_header_t;
+
+typedef struct size_classT
+{
+    block_t* local_list;
+    block_t* global_list;
+    int slack;
+} size_class_t;
+
 /************Global Variables*********************************************/
+static size_class_t classes[NUMORDERS];
 
-/************Function Prototypes******************************************/
+// the orders, then runs of pages; split pages count in the first order,
+// locally free blocks count as free
+static kma_stats_t stats = { NUMORDERS + 1 };
+static page_cache_t page_cache = { PAGECACHE_LOW, PAGECACHE_HIGH, &stats };
 
+/************Function Prototypes******************************************/
+int choose_order(kma_size_t);
+void push_block(block_t**, block_t*);
+void unlink_block(block_t**, block_t*);
+int bit_index(void*, int);
+int is_global_free(void*, int);
+void set_global_free(void*, int, int);
+void add_new_page(void);
+block_t* take_global(int);
+void release_global(block_t*, int);
+void free_buddy_page(page_header_t*);
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
@@ -65,13 +134,287 @@
 void*
 kma_malloc(kma_size_t size)
 {
-  return NULL;
+    int order = choose_order(size);
+    if(order == NUMORDERS)
+    {
+        stats.classes[NUMORDERS].pages += NUMPAGES(size);
+        stats_alloc(&stats, NUMORDERS, size, NUMPAGES(size) * PAGESIZE, 0);
+        return cache_get_pages(&page_cache, NUMPAGES(size))->ptr;
+    }
+
+    size_class_t* size_class = &classes[order];
+    block_t* block = size_class->local_list;
+    stats_alloc(&stats, order, size, BLOCKSIZE(order), 0);
+    if(block != NULL)
+    {
+        unlink_block(&size_class->local_list, block);
+        size_class->slack += 2;
+        stats_blocks(&stats, order, -1, BLOCKSIZE(order));
+        return (void*)block;
+    }
+    block = take_global(order);
+    size_class->slack += 1;
+    return (void*)block;
+}
+
+/* Smallest order holding size, NUMORDERS for a run of whole pages */
+int
+choose_order(kma_size_t size)
+{
+    int order = size_to_class(size, MINSHIFT);
+    return (order > NUMORDERS) ? NUMORDERS : order;
+}
+
+void
+push_block(block_t** list, block_t* block)
+{
+    block->next = *list;
+    block->prev = NULL;
+    if(*list != NULL)
+        (*list)->prev = block;
+    *list = block;
+}
+
+void
+unlink_block(block_t** list, block_t* block)
+{
+    if(block->prev != NULL)
+        block->prev->next = block->next;
+    else
+        *list = block->next;
+    if(block->next != NULL)
+        block->next->prev = block->prev;
+}
+
+/* Bits of order k start right after the UNITS >> j bits of every order j < k */
+int
+bit_index(void* block, int order)
+{
+    int offset = block - BASEADDR(block);
+    return (2 * UNITS - ((2 * UNITS) >> order)) + (offset >> (MINSHIFT + order));
+}
+
+int
+is_global_free(void* block, int order)
+{
+    page_header_t* header = BASEADDR(block);
+    int bit = bit_index(block, order);
+    return (header->free_map[bit / 8] >> (bit % 8)) & 1;
+}
+
+void
+set_global_free(void* block, int order, int value)
+{
+    page_header_t* header = BASEADDR(block);
+    int bit = bit_index(block, order);
+    if(value)
+        header->free_map[bit / 8] |= 1 << (bit % 8);
+    else
+        header->free_map[bit / 8] &= ~(1 << (bit % 8));
+}
+
+/* Lay out a fresh page: the header block followed by one globally free
+ * block of every order from HEADERORDER up.
+ */
+void
+add_new_page(void)
+{
+    kpage_t* page = cache_get_page(&page_cache);
+    page_header_t* header = (page_header_t*)page->ptr;
+    memset(header, 0, sizeof(page_header_t));
+    header->page = page;
+    stats.classes[0].pages++;
+    stats.header_bytes += BLOCKSIZE(HEADERORDER);
+    int order;
+    for(order = 0; order < NUMORDERS; order++)
+        stats.classes[order].size = BLOCKSIZE(order);
+    for(order = HEADERORDER; order < NUMORDERS; order++)
+    {
+        block_t* block = page->ptr + BLOCKSIZE(order);
+        push_block(&classes[order].global_list, block);
+        set_global_free(block, order, TRUE);
+        stats_blocks(&stats, order, 1, BLOCKSIZE(order));
+    }
+}
+
+/* Take a globally free block of the given order, splitting a larger one
+ * if needed. Splitting leaves every slack alone since it turns one free
+ * block into free blocks of the next order down.
+ */
+block_t*
+take_global(int order)
+{
+    int k = order;
+    while(k < NUMORDERS && classes[k].global_list == NULL)
+        k++;
+    if(k == NUMORDERS)
+    {
+        add_new_page();
+        k = order < HEADERORDER ? HEADERORDER : order;
+    }
+
+    block_t* block = classes[k].global_list;
+    unlink_block(&classes[k].global_list, block);
+    set_global_free(block, k, FALSE);
+    stats_blocks(&stats, k, -1, BLOCKSIZE(k));
+    while(k > order)
+    {
+        k--;
+        block_t* buddy = (void*)block + BLOCKSIZE(k);
+        push_block(&classes[k].global_list, buddy);
+        set_global_free(buddy, k, TRUE);
+        stats_blocks(&stats, k, 1, BLOCKSIZE(k));
+        stats.classes[k].splits++;
+    }
+    ((page_header_t*)BASEADDR(block))->used += 1 << order;
+    return block;
+}
+
+/* Make a block globally free and coalesce it with its buddies for as long
+ * as they are globally free too. Returns the page once nothing is in use.
+ */
+void
+release_global(block_t* block, int order)
+{
+    page_header_t* header = BASEADDR(block);
+    header->used -= 1 << order;
+    while(order < NUMORDERS - 1)
+    {
+        int offset = (void*)block - (void*)header;
+        block_t* buddy = (void*)header + (offset ^ BLOCKSIZE(order));
+        if(!is_global_free(buddy, order))
+            break;
+        unlink_block(&classes[order].global_list, buddy);
+        set_global_free(buddy, order, FALSE);
+        stats_blocks(&stats, order, -1, BLOCKSIZE(order));
+        stats.classes[order].coalesces++;
+        if(buddy < block)
+            block = buddy;
+        order++;
+    }
+    push_block(&classes[order].global_list, block);
+    set_global_free(block, order, TRUE);
+    stats_blocks(&stats, order, 1, BLOCKSIZE(order));
+
+    if(header->used == 0)
+        free_buddy_page(header);
+}
+
+/* An unused page is fully coalesced, so it is exactly the blocks laid out
+ * by add_new_page.
+ */
+void
+free_buddy_page(page_header_t* header)
+{
+    int order;
+    for(order = HEADERORDER; order < NUMORDERS; order++)
+    {
+        block_t* block = (void*)header + BLOCKSIZE(order);
+        assert(is_global_free(block, order));
+        unlink_block(&classes[order].global_list, block);
+        stats_blocks(&stats, order, -1, BLOCKSIZE(order));
+    }
+    stats.classes[0].pages--;
+    stats.header_bytes -= BLOCKSIZE(HEADERORDER);
+    cache_free_page(&page_cache, header->page);
 }
 
 void
 kma_free(void* ptr, kma_size_t size)
 {
-  ;
+    int order = choose_order(size);
+    if(order == NUMORDERS)
+    {
+        stats.classes[NUMORDERS].pages -= NUMPAGES(size);
+        stats_free(&stats, NUMORDERS, size, NUMPAGES(size) * PAGESIZE, 0);
+        cache_free_pages(&page_cache, page_descriptor(ptr));
+        return;
+    }
+
+    size_class_t* size_class = &classes[order];
+    stats_free(&stats, order, size, BLOCKSIZE(order), 0);
+    if(size_class->slack >= 2)
+    {
+        // lazy: keep it for the next request of this size
+        push_block(&size_class->local_list, (block_t*)ptr);
+        size_class->slack -= 2;
+        stats_blocks(&stats, order, 1, BLOCKSIZE(order));
+        return;
+    }
+    if(size_class->slack == 0)
+    {
+        // accelerated: also give back one locally free block
+        block_t* local = size_class->local_list;
+        assert(local != NULL);
+        unlink_block(&size_class->local_list, local);
+        size_class->slack += 1;
+        stats_blocks(&stats, order, -1, BLOCKSIZE(order));
+        release_global(local, order);
+    }
+    size_class->slack -= 1;
+    release_global((block_t*)ptr, order);
+}
+
+/* Within an order, or a run of the same number of pages, nothing moves */
+int
+kma_resize(void* ptr, kma_size_t old_size, kma_size_t new_size)
+{
+    int order = choose_order(old_size);
+    if(order != choose_order(new_size))
+        return FALSE;
+    if(order == NUMORDERS)
+    {
+        if(NUMPAGES(old_size) != NUMPAGES(new_size))
+            return FALSE;
+        kma_size_t run = NUMPAGES(old_size) * PAGESIZE;
+        stats_free(&stats, NUMORDERS, old_size, run, 0);
+        stats_alloc(&stats, NUMORDERS, new_size, run, 0);
+        return TRUE;
+    }
+    stats_free(&stats, order, old_size, BLOCKSIZE(order), 0);
+    stats_alloc(&stats, order, new_size, BLOCKSIZE(order), 0);
+    return TRUE;
+}
+
+/* Only runs come straight from kpage, blocks have held list links */
+int
+kma_zeroed(void* ptr, kma_size_t size)
+{
+    return choose_order(size) == NUMORDERS && page_descriptor(ptr)->zero;
+}
+
+/* The slack of a class is kept per block, so one block at a time */
+int
+kma_malloc_batch(kma_size_t size, int n, void** out)
+{
+    int i;
+    for(i = 0; i < n; i++)
+    {
+        out[i] = kma_malloc(size);
+        if(out[i] == NULL)
+            break;
+    }
+    return i;
+}
+
+void
+kma_free_batch(void** ptrs, kma_size_t size, int n)
+{
+    int i;
+    for(i = 0; i < n; i++)
+        kma_free(ptrs[i], size);
+}
+
+/* The page cache empties by itself once every page is freed */
+void
+kma_drain(void)
+{
+}
+
+kma_stats_t*
+kma_stats(void)
+{
+    return &stats;
 }
 
 #endif // KMA_LZBUD
@@ -42,10 +42,14 @@
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 /************Private include**********************************************/
 #include "kpage.h"
 #include "kma.h"
+#include "kma_size.h"
+#include "kma_stats.h"
+#include "kma_cache.h"
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -54,10 +58,65 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+/*
+ * Every data page holds blocks of a single power-of-two size. What a page
+ * holds is recorded in a usage table indexed by the page's position in the
+ * pool, so blocks need no header: a 64 byte request gets a 64 byte block.
+ * The usage table is split into chunks of one page each which are only
+ * brought in when a page they describe is used. The class free lists, the
+ * chunk directory and the page counter live on a control page.
+ */
+
+#define MINBLOCKSIZE 16
+
+#define MINSHIFT 4
+
+#define NUMCLASSES NUMSIZES(MINSHIFT) // 16, 32, ..., PAGESIZE
+
+typedef struct blockT
+{
+    struct blockT* next;
+    struct blockT* prev;
+} block_t;
+
+typedef struct usageT
+{
+    kpage_t* page;
+    short size_class;
+    short num_free;
+} usage_t;
+
+#define USAGEPERCHUNK (PAGESIZE / sizeof(usage_t))
+
+#define NUMCHUNKS ((POOLPAGES + USAGEPERCHUNK - 1) / USAGEPERCHUNK)
+
+typedef struct controlT
+{
+    kpage_t* page;
+    int num_pages; // data pages in use
+    block_t* free_list[NUMCLASSES];
+    usage_t* usage[NUMCHUNKS];
+    kpage_t* usage_page[NUMCHUNKS];
+    int usage_count[NUMCHUNKS]; // data pages described by the chunk
+} control_t;
+
 /************Global Variables*********************************************/
+static control_t* control = NULL;
 
-/************Function Prototypes******************************************/
+// the block sizes, then runs of pages
+static kma_stats_t stats = { NUMCLASSES + 1 };
+static page_cache_t page_cache = { PAGECACHE_LOW, PAGECACHE_HIGH, &stats };
 
+/************Function Prototypes******************************************/
+int choose_class(kma_size_t);
+void init_control(void);
+void deinit_control(void);
+usage_t* get_usage(void*, int);
+void put_usage(void*);
+int add_new_page(int);
+void push_block(int, block_t*);
+void unlink_block(int, block_t*);
+void free_class_page(usage_t*, void*);
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
@@ -65,13 +124,241 @@
 void*
 kma_malloc(kma_size_t size)
 {
-  return NULL;
+    int size_class = choose_class(size);
+    if(size_class == -1)
+    {
+        stats.classes[NUMCLASSES].pages += NUMPAGES(size);
+        stats_alloc(&stats, NUMCLASSES, size, NUMPAGES(size) * PAGESIZE, 0);
+        return cache_get_pages(&page_cache, NUMPAGES(size))->ptr;
+    }
+    if(control == NULL)
+        init_control();
+    block_t* block = control->free_list[size_class];
+    if(block == NULL)
+    {
+        if(add_new_page(size_class) == -1)
+            return NULL;
+        block = control->free_list[size_class];
+    }
+    unlink_block(size_class, block);
+    get_usage(block, FALSE)->num_free--;
+    stats_blocks(&stats, size_class, -1, MINBLOCKSIZE << size_class);
+    stats_alloc(&stats, size_class, size, MINBLOCKSIZE << size_class, 0);
+    return (void*)block;
+}
+
+/* Index of the smallest power of two that holds size, -1 for a run of pages */
+int
+choose_class(kma_size_t size)
+{
+    int size_class = size_to_class(size, MINSHIFT);
+    if(size_class >= NUMCLASSES)
+        return -1;
+    return size_class;
+}
+
+void
+init_control(void)
+{
+    kpage_t* page = cache_get_page(&page_cache);
+    control = (control_t*)page->ptr;
+    memset(control, 0, sizeof(control_t));
+    control->page = page;
+    int i;
+    for(i = 0; i < NUMCLASSES; i++)
+        stats.classes[i].size = MINBLOCKSIZE << i;
+    stats.header_bytes += PAGESIZE;
+}
+
+void
+deinit_control(void)
+{
+    stats.header_bytes -= PAGESIZE;
+    cache_free_page(&page_cache, control->page);
+    control = NULL;
+}
+
+/* Usage entry for the page holding ptr, bringing in its chunk if asked */
+usage_t*
+get_usage(void* ptr, int create)
+{
+    int index = page_index(ptr);
+    int chunk = index / USAGEPERCHUNK;
+    if(control->usage[chunk] == NULL)
+    {
+        assert(create);
+        kpage_t* page = cache_get_page(&page_cache);
+        control->usage[chunk] = (usage_t*)page->ptr;
+        control->usage_page[chunk] = page;
+        stats.header_bytes += PAGESIZE;
+    }
+    return &control->usage[chunk][index % USAGEPERCHUNK];
+}
+
+/* Forget the page holding ptr, dropping its chunk once nothing uses it */
+void
+put_usage(void* ptr)
+{
+    int chunk = page_index(ptr) / USAGEPERCHUNK;
+    control->usage_count[chunk]--;
+    if(control->usage_count[chunk] == 0)
+    {
+        stats.header_bytes -= PAGESIZE;
+        cache_free_page(&page_cache, control->usage_page[chunk]);
+        control->usage[chunk] = NULL;
+        control->usage_page[chunk] = NULL;
+    }
+}
+
+/* Get a page, record its class and cut it into blocks on the free list */
+int
+add_new_page(int size_class)
+{
+    kpage_t* page = cache_get_page(&page_cache);
+    if(page == NULL)
+        return -1;
+    kma_size_t block_size = MINBLOCKSIZE << size_class;
+    usage_t* usage = get_usage(page->ptr, TRUE);
+    control->usage_count[page_index(page->ptr) / USAGEPERCHUNK]++;
+    control->num_pages++;
+    usage->page = page;
+    usage->size_class = size_class;
+    usage->num_free = PAGESIZE / block_size;
+
+    // push from the back so blocks are handed out in address order
+    kma_size_t offset;
+    for(offset = PAGESIZE - block_size; offset >= 0; offset -= block_size)
+        push_block(size_class, (block_t*)(page->ptr + offset));
+    stats.classes[size_class].pages++;
+    stats_blocks(&stats, size_class, PAGESIZE / block_size, block_size);
+    return 0;
+}
+
+void
+push_block(int size_class, block_t* block)
+{
+    block_t* head = control->free_list[size_class];
+    block->next = head;
+    block->prev = NULL;
+    if(head != NULL)
+        head->prev = block;
+    control->free_list[size_class] = block;
+}
+
+void
+unlink_block(int size_class, block_t* block)
+{
+    if(block->prev != NULL)
+        block->prev->next = block->next;
+    else
+        control->free_list[size_class] = block->next;
+    if(block->next != NULL)
+        block->next->prev = block->prev;
 }
 
+/*
+ * The size class comes from the usage table, not from a header, so freeing
+ * is a push onto the class free list. Only when that makes the whole page
+ * free are its blocks unlinked and the page returned.
+ */
 void
 kma_free(void* ptr, kma_size_t size)
 {
-  ;
+    if(choose_class(size) == -1)
+    {
+        stats.classes[NUMCLASSES].pages -= NUMPAGES(size);
+        stats_free(&stats, NUMCLASSES, size, NUMPAGES(size) * PAGESIZE, 0);
+        cache_free_pages(&page_cache, page_descriptor(ptr));
+        return;
+    }
+    usage_t* usage = get_usage(ptr, FALSE);
+    int size_class = usage->size_class;
+    push_block(size_class, (block_t*)ptr);
+    usage->num_free++;
+    stats_free(&stats, size_class, size, MINBLOCKSIZE << size_class, 0);
+    stats_blocks(&stats, size_class, 1, MINBLOCKSIZE << size_class);
+    if(usage->num_free == PAGESIZE / (MINBLOCKSIZE << size_class))
+        free_class_page(usage, BASEADDR(ptr));
+    if(control->num_pages == 0)
+        deinit_control();
+}
+
+void
+free_class_page(usage_t* usage, void* base)
+{
+    kma_size_t block_size = MINBLOCKSIZE << usage->size_class;
+    kma_size_t offset;
+    for(offset = 0; offset < PAGESIZE; offset += block_size)
+        unlink_block(usage->size_class, (block_t*)(base + offset));
+    stats.classes[usage->size_class].pages--;
+    stats_blocks(&stats, usage->size_class, -(PAGESIZE / block_size),
+                 block_size);
+    cache_free_page(&page_cache, usage->page);
+    usage->page = NULL;
+    control->num_pages--;
+    put_usage(base);
+}
+
+/* Within a class, or a run of the same number of pages, nothing moves */
+int
+kma_resize(void* ptr, kma_size_t old_size, kma_size_t new_size)
+{
+    int size_class = choose_class(old_size);
+    if(size_class != choose_class(new_size))
+        return FALSE;
+    if(size_class == -1)
+    {
+        if(NUMPAGES(old_size) != NUMPAGES(new_size))
+            return FALSE;
+        kma_size_t run = NUMPAGES(old_size) * PAGESIZE;
+        stats_free(&stats, NUMCLASSES, old_size, run, 0);
+        stats_alloc(&stats, NUMCLASSES, new_size, run, 0);
+        return TRUE;
+    }
+    stats_free(&stats, size_class, old_size, MINBLOCKSIZE << size_class, 0);
+    stats_alloc(&stats, size_class, new_size, MINBLOCKSIZE << size_class, 0);
+    return TRUE;
+}
+
+/* Only runs come straight from kpage, blocks have held free list links */
+int
+kma_zeroed(void* ptr, kma_size_t size)
+{
+    return choose_class(size) == -1 && page_descriptor(ptr)->zero;
+}
+
+/* Blocks one at a time: finding the class is a shift already */
+int
+kma_malloc_batch(kma_size_t size, int n, void** out)
+{
+    int i;
+    for(i = 0; i < n; i++)
+    {
+        out[i] = kma_malloc(size);
+        if(out[i] == NULL)
+            break;
+    }
+    return i;
+}
+
+void
+kma_free_batch(void** ptrs, kma_size_t size, int n)
+{
+    int i;
+    for(i = 0; i < n; i++)
+        kma_free(ptrs[i], size);
+}
+
+/* The page cache empties by itself once every page is freed */
+void
+kma_drain(void)
+{
+}
+
+kma_stats_t*
+kma_stats(void)
+{
+    return &stats;
 }
 
 #endif // KMA_MCK2
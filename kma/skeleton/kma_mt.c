@@ -0,0 +1,609 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Thread-safe front end with per-thread magazine caches
+ *    File: kma_mt.c
+ ***************************************************************************/
+#ifdef KMA_MT
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/************Private include**********************************************/
+#include "kpage.h"
+#include "kma.h"
+#include "kma_size.h"
+#include "kma_stats.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/*
+ * Magazines as in Bonwick & Adams: every thread keeps a loaded and a
+ * previous magazine (a bounded LIFO of free blocks) per size class and
+ * serves kma_malloc/kma_free from them without any lock. Only when both are
+ * empty (or full) does it trade a whole magazine with the depot of that
+ * class, which has its own lock. The allocator underneath is not
+ * thread-safe, so it is only called under backend_lock, and always for a
+ * whole magazine's worth of blocks at once, as one batch.
+ *
+ * Blocks are cached in classes four to a power of two (16, 32, 48, 64, 80,
+ * 96, 112, 128, 160, ...) and always taken from the backend at the full
+ * class size, so any cached block fits any request of its class. Requests
+ * above MAXCACHED go to the backend directly.
+ *
+ * To the backend every cached block is live and as large as its class.
+ * Each thread counts the bytes of the blocks in magazines, which are free
+ * memory, and how much larger than their requests the blocks it handed
+ * out are, which is rounding; the caches are linked so that kma_stats can
+ * add these up. Writes are plain and only ever made by the owning thread,
+ * so the sum is exact once the threads are quiet.
+ */
+
+#define MAGSIZE 16
+
+#define DEPOTMAX 8 // full magazines kept per class
+
+#define MAXCACHED (PAGESIZE / 2)
+
+#define NUMCLASSES NUMQUARTERS(PAGESHIFT - 1) // 16, ..., MAXCACHED
+
+typedef struct magazineT
+{
+  struct magazineT* next;
+  int rounds;
+  void* round[MAGSIZE];
+} magazine_t;
+
+typedef struct depotT
+{
+  pthread_mutex_t lock;
+  magazine_t* full;
+  magazine_t* empty;
+  int num_full;
+} depot_t;
+
+typedef struct cacheT
+{
+  magazine_t* loaded[NUMCLASSES];
+  magazine_t* previous[NUMCLASSES];
+  long held_bytes;     // in magazines, may go negative: frees
+  long rounding_bytes; // and refills happen on any thread
+  int bound;
+  struct cacheT* next;
+} cache_t;
+
+/************Global Variables*********************************************/
+static pthread_mutex_t backend_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static depot_t depot[NUMCLASSES];
+static __thread cache_t cache;
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static cache_t* caches;         // of the live threads that ever traded
+static long gone_held_bytes;    // counters of the threads that exited
+static long gone_rounding_bytes;
+static long magazine_bytes;     // under backend_lock
+
+/************Function Prototypes******************************************/
+int choose_magazine_class(kma_size_t);
+void init_depot(void);
+void bind_cache(void);
+void flush_cache(void*);
+void retire_cache(void*);
+void count_bytes(long, long);
+magazine_t* new_magazine(void);
+void fill_magazine(magazine_t*, int);
+void empty_magazine(magazine_t*, int);
+void free_magazine(magazine_t*);
+magazine_t* depot_get_full(int);
+magazine_t* depot_get_empty(int);
+void depot_put_full(int, magazine_t*);
+void depot_put_empty(int, magazine_t*);
+magazine_t* load_magazine(int);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void*
+kma_malloc(kma_size_t size)
+{
+  int size_class = choose_magazine_class(size);
+  void* ptr;
+
+  if (size_class == -1)
+    {
+      pthread_mutex_lock(&backend_lock);
+      ptr = kma_backend_malloc(size);
+      pthread_mutex_unlock(&backend_lock);
+      return ptr;
+    }
+
+  magazine_t* loaded = cache.loaded[size_class];
+  if (loaded == NULL || loaded->rounds == 0)
+    {
+      magazine_t* previous = cache.previous[size_class];
+      if (previous != NULL && previous->rounds > 0)
+	{
+	  cache.previous[size_class] = loaded;
+	  cache.loaded[size_class] = previous;
+	}
+      else
+	{
+	  // trade the empty previous magazine for a full one
+	  bind_cache();
+	  magazine_t* full = depot_get_full(size_class);
+	  if (full == NULL)
+	    {
+	      full = load_magazine(size_class);
+	      if (full == NULL)
+		{
+		  return NULL;
+		}
+	    }
+	  if (previous != NULL)
+	    {
+	      depot_put_empty(size_class, previous);
+	    }
+	  cache.previous[size_class] = loaded;
+	  cache.loaded[size_class] = full;
+	}
+      loaded = cache.loaded[size_class];
+    }
+
+  kma_size_t block = quarter_class_size(size_class);
+  count_bytes(-(long) block, block - size);
+  return loaded->round[--loaded->rounds];
+}
+
+void
+kma_free(void* ptr, kma_size_t size)
+{
+  int size_class = choose_magazine_class(size);
+
+  if (size_class == -1)
+    {
+      pthread_mutex_lock(&backend_lock);
+      kma_backend_free(ptr, size);
+      pthread_mutex_unlock(&backend_lock);
+      return;
+    }
+
+  magazine_t* loaded = cache.loaded[size_class];
+  if (loaded == NULL || loaded->rounds == MAGSIZE)
+    {
+      magazine_t* previous = cache.previous[size_class];
+      if (previous != NULL && previous->rounds < MAGSIZE)
+	{
+	  cache.previous[size_class] = loaded;
+	  cache.loaded[size_class] = previous;
+	}
+      else
+	{
+	  // trade the full previous magazine for an empty one
+	  bind_cache();
+	  magazine_t* empty = depot_get_empty(size_class);
+	  if (empty == NULL)
+	    {
+	      empty = new_magazine();
+	    }
+	  if (previous != NULL)
+	    {
+	      depot_put_full(size_class, previous);
+	    }
+	  cache.previous[size_class] = loaded;
+	  cache.loaded[size_class] = empty;
+	}
+      loaded = cache.loaded[size_class];
+    }
+
+  kma_size_t block = quarter_class_size(size_class);
+  count_bytes(block, -(long) (block - size));
+  loaded->round[loaded->rounds++] = ptr;
+}
+
+/* -1 above MAXCACHED */
+int
+choose_magazine_class(kma_size_t size)
+{
+  if (size > MAXCACHED)
+    {
+      return -1;
+    }
+  return size_to_quarter_class(size);
+}
+
+void
+init_depot(void)
+{
+  int i;
+
+  for (i = 0; i < NUMCLASSES; i++)
+    {
+      pthread_mutex_init(&depot[i].lock, NULL);
+      depot[i].full = NULL;
+      depot[i].empty = NULL;
+      depot[i].num_full = 0;
+    }
+  pthread_key_create(&cache_key, retire_cache);
+}
+
+/* Make sure the depot exists, and that this thread's cache is counted
+ * and flushed on exit
+ */
+void
+bind_cache(void)
+{
+  if (cache.bound)
+    {
+      return;
+    }
+  pthread_once(&init_once, init_depot);
+  pthread_setspecific(cache_key, &cache);
+  pthread_mutex_lock(&caches_lock);
+  cache.next = caches;
+  caches = &cache;
+  cache.bound = TRUE;
+  pthread_mutex_unlock(&caches_lock);
+}
+
+/* Only ever called by the thread that owns the cache */
+void
+count_bytes(long held, long rounding)
+{
+  __atomic_store_n(&cache.held_bytes, cache.held_bytes + held,
+		   __ATOMIC_RELAXED);
+  __atomic_store_n(&cache.rounding_bytes, cache.rounding_bytes + rounding,
+		   __ATOMIC_RELAXED);
+}
+
+/* Magazines live in backend memory too, so they are counted as headers */
+magazine_t*
+new_magazine(void)
+{
+  magazine_t* mag;
+
+  pthread_mutex_lock(&backend_lock);
+  mag = kma_backend_malloc(sizeof(magazine_t));
+  magazine_bytes += sizeof(magazine_t);
+  pthread_mutex_unlock(&backend_lock);
+  assert(mag != NULL);
+  mag->next = NULL;
+  mag->rounds = 0;
+  return mag;
+}
+
+void
+free_magazine(magazine_t* mag)
+{
+  pthread_mutex_lock(&backend_lock);
+  kma_backend_free(mag, sizeof(magazine_t));
+  magazine_bytes -= sizeof(magazine_t);
+  pthread_mutex_unlock(&backend_lock);
+}
+
+/* Allocate a whole magazine's worth of blocks as one backend batch */
+void
+fill_magazine(magazine_t* mag, int size_class)
+{
+  kma_size_t size = quarter_class_size(size_class);
+  int n;
+
+  pthread_mutex_lock(&backend_lock);
+  n = kma_backend_malloc_batch(size, MAGSIZE - mag->rounds,
+			       &mag->round[mag->rounds]);
+  mag->rounds += n;
+  pthread_mutex_unlock(&backend_lock);
+  count_bytes((long) n * size, 0);
+}
+
+/* Return every block of a magazine as one backend batch */
+void
+empty_magazine(magazine_t* mag, int size_class)
+{
+  kma_size_t size = quarter_class_size(size_class);
+
+  pthread_mutex_lock(&backend_lock);
+  kma_backend_free_batch(mag->round, size, mag->rounds);
+  pthread_mutex_unlock(&backend_lock);
+  count_bytes(-(long) mag->rounds * size, 0);
+  mag->rounds = 0;
+}
+
+/* A full magazine straight from the backend, when the depot has none */
+magazine_t*
+load_magazine(int size_class)
+{
+  magazine_t* mag;
+
+  mag = depot_get_empty(size_class);
+  if (mag == NULL)
+    {
+      mag = new_magazine();
+    }
+  fill_magazine(mag, size_class);
+  if (mag->rounds == 0)
+    {
+      free_magazine(mag);
+      return NULL;
+    }
+  return mag;
+}
+
+magazine_t*
+depot_get_full(int size_class)
+{
+  depot_t* d = &depot[size_class];
+  magazine_t* mag;
+
+  pthread_mutex_lock(&d->lock);
+  mag = d->full;
+  if (mag != NULL)
+    {
+      d->full = mag->next;
+      d->num_full--;
+    }
+  pthread_mutex_unlock(&d->lock);
+  return mag;
+}
+
+magazine_t*
+depot_get_empty(int size_class)
+{
+  depot_t* d = &depot[size_class];
+  magazine_t* mag;
+
+  pthread_mutex_lock(&d->lock);
+  mag = d->empty;
+  if (mag != NULL)
+    {
+      d->empty = mag->next;
+    }
+  pthread_mutex_unlock(&d->lock);
+  return mag;
+}
+
+/* Keep at most DEPOTMAX full magazines, give the rest back to the backend */
+void
+depot_put_full(int size_class, magazine_t* mag)
+{
+  depot_t* d = &depot[size_class];
+
+  pthread_mutex_lock(&d->lock);
+  if (d->num_full < DEPOTMAX)
+    {
+      mag->next = d->full;
+      d->full = mag;
+      d->num_full++;
+      mag = NULL;
+    }
+  pthread_mutex_unlock(&d->lock);
+
+  if (mag != NULL)
+    {
+      empty_magazine(mag, size_class);
+      depot_put_empty(size_class, mag);
+    }
+}
+
+void
+depot_put_empty(int size_class, magazine_t* mag)
+{
+  depot_t* d = &depot[size_class];
+
+  assert(mag->rounds == 0);
+  pthread_mutex_lock(&d->lock);
+  mag->next = d->empty;
+  d->empty = mag;
+  pthread_mutex_unlock(&d->lock);
+}
+
+/* Thread exit: give the thread's blocks and magazines back to the backend */
+void
+flush_cache(void* arg)
+{
+  cache_t* c = arg;
+  int i;
+
+  for (i = 0; i < NUMCLASSES; i++)
+    {
+      if (c->loaded[i] != NULL)
+	{
+	  empty_magazine(c->loaded[i], i);
+	  free_magazine(c->loaded[i]);
+	  c->loaded[i] = NULL;
+	}
+      if (c->previous[i] != NULL)
+	{
+	  empty_magazine(c->previous[i], i);
+	  free_magazine(c->previous[i]);
+	  c->previous[i] = NULL;
+	}
+    }
+}
+
+/* Thread exit: flush, then keep what the thread counted */
+void
+retire_cache(void* arg)
+{
+  cache_t* c = arg;
+  cache_t** link;
+
+  flush_cache(c);
+  pthread_mutex_lock(&caches_lock);
+  for (link = &caches; *link != c; link = &(*link)->next)
+    ;
+  *link = c->next;
+  gone_held_bytes += c->held_bytes;
+  gone_rounding_bytes += c->rounding_bytes;
+  pthread_mutex_unlock(&caches_lock);
+}
+
+void
+kma_drain(void)
+{
+  int i;
+
+  bind_cache();
+  flush_cache(&cache);
+
+  for (i = 0; i < NUMCLASSES; i++)
+    {
+      depot_t* d = &depot[i];
+      magazine_t* full;
+      magazine_t* empty;
+
+      pthread_mutex_lock(&d->lock);
+      full = d->full;
+      empty = d->empty;
+      d->full = NULL;
+      d->empty = NULL;
+      d->num_full = 0;
+      pthread_mutex_unlock(&d->lock);
+
+      while (full != NULL)
+	{
+	  magazine_t* next = full->next;
+	  empty_magazine(full, i);
+	  free_magazine(full);
+	  full = next;
+	}
+      while (empty != NULL)
+	{
+	  magazine_t* next = empty->next;
+	  free_magazine(empty);
+	  empty = next;
+	}
+    }
+
+  pthread_mutex_lock(&backend_lock);
+  kma_backend_drain();
+  pthread_mutex_unlock(&backend_lock);
+}
+
+/* Cached blocks were taken at the full size of their class, so they fit
+ * any size of it; larger ones are up to the backend.
+ */
+int
+kma_resize(void* ptr, kma_size_t old_size, kma_size_t new_size)
+{
+  int size_class = choose_magazine_class(old_size);
+  int res;
+
+  if (size_class != -1 || choose_magazine_class(new_size) != -1)
+    {
+      if (size_class != choose_magazine_class(new_size))
+	{
+	  return FALSE;
+	}
+      bind_cache();
+      count_bytes(0, (long) old_size - (long) new_size);
+      return TRUE;
+    }
+  pthread_mutex_lock(&backend_lock);
+  res = kma_backend_resize(ptr, old_size, new_size);
+  pthread_mutex_unlock(&backend_lock);
+  return res;
+}
+
+int
+kma_zeroed(void* ptr, kma_size_t size)
+{
+  int res;
+
+  if (choose_magazine_class(size) != -1)
+    {
+      return FALSE;
+    }
+  pthread_mutex_lock(&backend_lock);
+  res = kma_backend_zeroed(ptr, size);
+  pthread_mutex_unlock(&backend_lock);
+  return res;
+}
+
+/* Cached blocks come off the magazines as they would one at a time, which
+ * takes no lock; larger ones go to the backend as one batch.
+ */
+int
+kma_malloc_batch(kma_size_t size, int n, void** out)
+{
+  int i;
+
+  if (choose_magazine_class(size) == -1)
+    {
+      pthread_mutex_lock(&backend_lock);
+      i = kma_backend_malloc_batch(size, n, out);
+      pthread_mutex_unlock(&backend_lock);
+      return i;
+    }
+  for (i = 0; i < n; i++)
+    {
+      out[i] = kma_malloc(size);
+      if (out[i] == NULL)
+	{
+	  break;
+	}
+    }
+  return i;
+}
+
+void
+kma_free_batch(void** ptrs, kma_size_t size, int n)
+{
+  int i;
+
+  if (choose_magazine_class(size) == -1)
+    {
+      pthread_mutex_lock(&backend_lock);
+      kma_backend_free_batch(ptrs, size, n);
+      pthread_mutex_unlock(&backend_lock);
+      return;
+    }
+  for (i = 0; i < n; i++)
+    {
+      kma_free(ptrs[i], size);
+    }
+}
+
+/* The backend's counters change under backend_lock, so copy them under it.
+ * Blocks in magazines are live to the backend at the size of their class:
+ * move them to free, the rest of the class size of the blocks handed out
+ * to rounding and the magazines themselves to headers.
+ */
+kma_stats_t*
+kma_stats(void)
+{
+  static kma_stats_t copy;
+  long held;
+  long rounding;
+  cache_t* c;
+
+  pthread_mutex_lock(&backend_lock);
+  memcpy(&copy, kma_backend_stats(), sizeof(kma_stats_t));
+  copy.header_bytes += magazine_bytes;
+  pthread_mutex_unlock(&backend_lock);
+
+  pthread_mutex_lock(&caches_lock);
+  held = gone_held_bytes;
+  rounding = gone_rounding_bytes;
+  for (c = caches; c != NULL; c = c->next)
+    {
+      held += __atomic_load_n(&c->held_bytes, __ATOMIC_RELAXED);
+      rounding += __atomic_load_n(&c->rounding_bytes, __ATOMIC_RELAXED);
+    }
+  pthread_mutex_unlock(&caches_lock);
+
+  copy.free_bytes += held;
+  copy.rounding_bytes += rounding;
+  return &copy;
+}
+
+#endif // KMA_MT
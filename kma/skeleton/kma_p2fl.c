@@ -47,6 +47,9 @@
 /************Private include**********************************************/
 #include "kpage.h"
 #include "kma.h"
+#include "kma_size.h"
+#include "kma_stats.h"
+#include "kma_cache.h"
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -55,26 +58,70 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+/*
+ * Every page holds buffers of one size. The header of the first buffer in a
+ * page doubles as the page's metadata: how many of its buffers are in use,
+ * the page's own free list and its links on the list of pages of that size
+ * that still have free buffers. Since the first buffer sits at the page's
+ * base address, BASEADDR finds it from any buffer in the page.
+ *
+ * Pages with free buffers are kept on NUMBUCKETS lists per size by how
+ * many of their buffers are in use, and buffers are taken from the fullest
+ * of them. New requests then fill up the pages that are nearly full and
+ * leave the nearly empty ones to drain and go back, instead of spreading
+ * live buffers over every page that ever had a free one.
+ */
 typedef struct bufferT
+{
+    kma_size_t live;              // first buffer: buffers handed out
+    int bucket;                   // first buffer: list of pages it is on
+    struct bufferT* next_buffer;  // next free buffer in the same page
+    struct bufferT* free_buffers; // first buffer: the page's free list
+    struct bufferT* next_page;    // first buffer: pages of the same size
+    struct bufferT* prev_page;    //   that have free buffers
+    kpage_t* page;                // first buffer: the page itself
+} buffer_t;
+
+#define MINSHIFT 6
+
+#define NUMCLASSES NUMSIZES(MINSHIFT) // 64, ..., PAGESIZE
+
+#define BUCKETSHIFT 3
+
+#define NUMBUCKETS (1 << BUCKETSHIFT)
+
+typedef struct size_headerT
 {
     kma_size_t size;
-    void* ptr;
-    struct bufferT* next_size;
-    struct bufferT* next_buffer;
+    int shift;                   // log2 of the buffers in a page
+    unsigned int buckets;        // bit b set while pages[b] is not empty
+    buffer_t* pages[NUMBUCKETS]; // pages with free buffers, by occupancy
+} size_header_t;
+
+/* Lives at the start of the control page */
+typedef struct size_tableT
+{
     kpage_t* page;
-} buffer_t;
+    int num_pages; // pages in use besides the control page
+    size_header_t sizes[NUMCLASSES];
+} size_table_t;
 
 /************Global Variables*********************************************/
-static buffer_t* size_table = NULL;
-const int MINBLOCKSIZE = 64;
+static size_table_t* size_table = NULL;
+
+// the buffer sizes, then runs of pages
+static kma_stats_t stats = { NUMCLASSES + 1 };
+static page_cache_t page_cache = { PAGECACHE_LOW, PAGECACHE_HIGH, &stats };
 /************Function Prototypes******************************************/
-kma_size_t choose_block_size(kma_size_t);
+int choose_class(kma_size_t);
 void deinit_size_table(void);
 void init_size_table(void);
-void* alloc_block(kma_size_t);
-buffer_t* make_buffers(kma_size_t);
-int last_buf_in_page(buffer_t* size_buf, kpage_t* page);
-void free_page_from_list(buffer_t* size_buf, kpage_t* page);
+void* alloc_block(size_header_t*);
+buffer_t* make_buffers(size_header_t*);
+buffer_t* fullest_page(size_header_t*);
+void link_page(size_header_t*, buffer_t*);
+void unlink_page(size_header_t*, buffer_t*);
+void update_bucket(size_header_t*, buffer_t*);
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
@@ -82,190 +129,352 @@ void free_page_from_list(buffer_t* size_buf, kpage_t* page);
 void*
 kma_malloc(kma_size_t size)
 {
+    int size_class = choose_class(size);
+    if(size_class == -1)
+    {
+        stats.classes[NUMCLASSES].pages += NUMPAGES(size);
+        stats_alloc(&stats, NUMCLASSES, size, NUMPAGES(size) * PAGESIZE, 0);
+        return cache_get_pages(&page_cache, NUMPAGES(size))->ptr;
+    }
     if(size_table == NULL)
         init_size_table();
-    kma_size_t block_size = choose_block_size(size);
-    if(block_size != -1)
-        return alloc_block(block_size);
-    return NULL;
+    void* ptr = alloc_block(&size_table->sizes[size_class]);
+    if(ptr != NULL)
+    {
+        kma_size_t block = size_table->sizes[size_class].size;
+        stats_blocks(&stats, size_class, -1, block);
+        stats_alloc(&stats, size_class, size, block, sizeof(buffer_t));
+    }
+    return ptr;
 }
 
-/* Go through size_table until block_size is found. Then find first buffer_t
- * on free list, take it off free list and return its ptr + sizeof(buffer_t*)
+/* Take the first free buffer of the fullest page of this size that has
+ * one, bringing in a new page if there is none.
  */
 void*
-alloc_block(kma_size_t block_size)
+alloc_block(size_header_t* top)
 {
-    buffer_t* top = size_table;
-    while(top->size < block_size)
-        top = top->next_size;
-    // found the right size
-    buffer_t* buf = top->next_buffer;
-    if(buf == NULL)
-    {
-        top->next_buffer = make_buffers(top->size);
-        buf = top->next_buffer;
-    }
-
-    if(buf == NULL)
+    buffer_t* first = fullest_page(top);
+    if(first == NULL)
+        first = make_buffers(top);
+    if(first == NULL)
         return NULL;
 
-    top->next_buffer = buf->next_buffer;
-    buf->next_buffer = top; // set ptr back to size
-    return (buf->ptr + sizeof(buffer_t));
+    buffer_t* buf = first->free_buffers;
+    first->free_buffers = buf->next_buffer;
+    first->live++;
+    if(first->free_buffers == NULL)
+        unlink_page(top, first); // page is full now
+    else
+        update_bucket(top, first);
+    return ((void*)buf + sizeof(buffer_t));
 }
 
 
-kma_size_t
-choose_block_size(kma_size_t size)
+/* Class of the smallest buffer holding size plus its header, -1 if it needs
+ * a run of pages
+ */
+int
+choose_class(kma_size_t size)
 {
-    int test_size = MINBLOCKSIZE;
-    while(test_size <= PAGESIZE)
-    {
-        if(test_size >= (size + sizeof(buffer_t)))
-            return test_size;
-        test_size *= 2;
-    }
-    return -1;
+    int size_class = size_to_class(size + sizeof(buffer_t), MINSHIFT);
+    if(size_class >= NUMCLASSES)
+        return -1;
+    return size_class;
 }
 
 void
 deinit_size_table(void)
 {
-    free_page(size_table->page);
+    stats.header_bytes -= PAGESIZE;
+    cache_free_page(&page_cache, size_table->page);
     size_table = NULL;
 }
 
 void
 init_size_table(void)
 {
-    int size = 0;
-    int offset = 0;
+    int i, b;
     //this is where we should be bringing down the initial control page
-    kpage_t* page = get_page();
-    buffer_t* top = page->ptr + offset;
-    offset += sizeof(buffer_t);
-    top->next_buffer = page->ptr + offset;
-    top->page = page;
-    top->size = 0;
-    top->ptr = NULL;
-    offset += sizeof(buffer_t);
-    buffer_t* counter = top->next_buffer;
-    counter->size = 0;
-    counter->next_buffer = NULL;
-    counter->next_size = NULL;
-    counter->ptr = NULL;
-    counter->page = page;
-    size = MINBLOCKSIZE;
-    size_table = top;
-    while(size <= PAGESIZE)
+    kpage_t* page = cache_get_page(&page_cache);
+    size_table = page->ptr;
+    size_table->page = page;
+    size_table->num_pages = 0;
+    for(i = 0; i < NUMCLASSES; i++)
     {
-        top->next_size = page->ptr + offset;
-        offset += sizeof(buffer_t);
-        top = top->next_size;
-        top->next_buffer = NULL;
-        top->size = size;
-        top->page = page;
-        size *= 2;
-        top->ptr = NULL;
+        size_table->sizes[i].size = 1 << (MINSHIFT + i);
+        size_table->sizes[i].shift = PAGESHIFT - MINSHIFT - i;
+        size_table->sizes[i].buckets = 0;
+        for(b = 0; b < NUMBUCKETS; b++)
+            size_table->sizes[i].pages[b] = NULL;
+        stats.classes[i].size = size_table->sizes[i].size;
     }
-    top->next_size = NULL;
+    stats.header_bytes += PAGESIZE;
 }
 
+/* Cut a new page into buffers, all on the page's free list */
 buffer_t*
-make_buffers(kma_size_t size)
+make_buffers(size_header_t* top)
 {
-    kpage_t* page = get_page();
+    kpage_t* page = cache_get_page(&page_cache);
     if(page == NULL)
         return NULL;
     //increment number of pages in use
-    size_table->next_buffer->size++;
-    kma_size_t offset = 0;
-    buffer_t* top = page->ptr + offset;
-    top->ptr = page->ptr + offset;
-    buffer_t* first = top;
-    top->next_size = NULL;
-    top->size = size;
-    top->page = page;
-    offset += size;
-    buffer_t* buf;
-    while(offset < PAGESIZE)
+    size_table->num_pages++;
+    buffer_t* first = page->ptr;
+    first->live = 0;
+    first->page = page;
+    first->free_buffers = NULL;
+    kma_size_t offset;
+    for(offset = PAGESIZE - top->size; offset >= 0; offset -= top->size)
     {
-        buf = page->ptr + offset;
-        buf->ptr = page->ptr + offset;
-        top->next_buffer = buf;
-        top = buf;
-        offset += size;
-        buf->next_size = NULL;
-        buf->size = size;
-        buf->page = page;
+        buffer_t* buf = page->ptr + offset;
+        buf->next_buffer = first->free_buffers;
+        first->free_buffers = buf;
     }
-    top->next_buffer = NULL;
+    link_page(top, first);
+    int size_class = top - size_table->sizes;
+    stats.classes[size_class].pages++;
+    stats_blocks(&stats, size_class, PAGESIZE / top->size, top->size);
     return first;
 }
 
+buffer_t*
+fullest_page(size_header_t* top)
+{
+    if(top->buckets == 0)
+        return NULL;
+    return top->pages[31 - __builtin_clz(top->buckets)];
+}
+
+/* Put a page that is not full on the list of its occupancy */
+void
+link_page(size_header_t* top, buffer_t* first)
+{
+    int b = (first->live << BUCKETSHIFT) >> top->shift;
+    buffer_t** head = &top->pages[b];
+    first->bucket = b;
+    first->prev_page = NULL;
+    first->next_page = *head;
+    if(first->next_page)
+        first->next_page->prev_page = first;
+    *head = first;
+    top->buckets |= 1U << b;
+}
+
+void
+unlink_page(size_header_t* top, buffer_t* first)
+{
+    if(first->prev_page)
+        first->prev_page->next_page = first->next_page;
+    else if((top->pages[first->bucket] = first->next_page) == NULL)
+        top->buckets &= ~(1U << first->bucket);
+    if(first->next_page)
+        first->next_page->prev_page = first->prev_page;
+}
 
+/* A page only changes lists every NUMBUCKETS-th of its buffers */
+void
+update_bucket(size_header_t* top, buffer_t* first)
+{
+    if(((first->live << BUCKETSHIFT) >> top->shift) != first->bucket)
+    {
+        unlink_page(top, first);
+        link_page(top, first);
+    }
+}
 
+
+/*
+ * Push the buffer on its page's free list. The first buffer of the page
+ * counts how many are in use, so an empty page is seen right away and taken
+ * off the lists of pages with free buffers as a whole.
+ */
 void
 kma_free(void* ptr, kma_size_t size)
 {
+    int size_class = choose_class(size);
+    if(size_class == -1)
+    {
+        stats.classes[NUMCLASSES].pages -= NUMPAGES(size);
+        stats_free(&stats, NUMCLASSES, size, NUMPAGES(size) * PAGESIZE, 0);
+        cache_free_pages(&page_cache, page_descriptor(ptr));
+        return;
+    }
     buffer_t* buf;
     buf = (buffer_t*)(ptr - sizeof(buffer_t));
-    buffer_t* size_buf = buf->next_buffer;
-    buf->next_buffer = size_buf->next_buffer;
-    size_buf->next_buffer = buf;
-    if(last_buf_in_page(size_buf, buf->page) == 1)
-        free_page_from_list(size_buf, buf->page);
-    if(size_table->next_buffer->size == 0)
+    buffer_t* first = BASEADDR(buf);
+    size_header_t* top = &size_table->sizes[size_class];
+    int was_full = (first->free_buffers == NULL);
+    buf->next_buffer = first->free_buffers;
+    first->free_buffers = buf;
+    first->live--;
+    stats_free(&stats, size_class, size, top->size, sizeof(buffer_t));
+    stats_blocks(&stats, size_class, 1, top->size);
+    if(first->live != 0)
+    {
+        if(was_full)
+            link_page(top, first);
+        else
+            update_bucket(top, first);
+    }
+    else
+    {
+        if(!was_full)
+            unlink_page(top, first);
+        size_table->num_pages--;
+        stats.classes[size_class].pages--;
+        stats_blocks(&stats, size_class, -(PAGESIZE / top->size), top->size);
+        cache_free_page(&page_cache, first->page);
+    }
+    if(size_table->num_pages == 0)
         deinit_size_table();
 }
 
+/* Within a class, or a run of the same number of pages, nothing moves */
+int
+kma_resize(void* ptr, kma_size_t old_size, kma_size_t new_size)
+{
+    int size_class = choose_class(old_size);
+    if(size_class != choose_class(new_size))
+        return FALSE;
+    if(size_class == -1)
+    {
+        if(NUMPAGES(old_size) != NUMPAGES(new_size))
+            return FALSE;
+        kma_size_t run = NUMPAGES(old_size) * PAGESIZE;
+        stats_free(&stats, NUMCLASSES, old_size, run, 0);
+        stats_alloc(&stats, NUMCLASSES, new_size, run, 0);
+        return TRUE;
+    }
+    kma_size_t block = size_table->sizes[size_class].size;
+    stats_free(&stats, size_class, old_size, block, sizeof(buffer_t));
+    stats_alloc(&stats, size_class, new_size, block, sizeof(buffer_t));
+    return TRUE;
+}
+
+/* Only runs come straight from kpage, buffers have held free list links */
+int
+kma_zeroed(void* ptr, kma_size_t size)
+{
+    return choose_class(size) == -1 && page_descriptor(ptr)->zero;
+}
+
+/*
+ * The class is looked up once, and each page gives up as many buffers as
+ * the batch still needs, with its count and free list head written once.
+ */
+int
+kma_malloc_batch(kma_size_t size, int n, void** out)
+{
+    int size_class = choose_class(size);
+    int i = 0;
+    if(n <= 0)
+        return 0;
+    if(size_class == -1)
+    {
+        for(i = 0; i < n; i++)
+            if((out[i] = kma_malloc(size)) == NULL)
+                break;
+        return i;
+    }
+    if(size_table == NULL)
+        init_size_table();
+    size_header_t* top = &size_table->sizes[size_class];
+    while(i < n)
+    {
+        buffer_t* first = fullest_page(top);
+        if(first == NULL)
+            first = make_buffers(top);
+        if(first == NULL)
+            break;
+        buffer_t* buf = first->free_buffers;
+        int taken = 0;
+        while(buf != NULL && i < n)
+        {
+            out[i++] = (void*)buf + sizeof(buffer_t);
+            buf = buf->next_buffer;
+            stats_alloc(&stats, size_class, size, top->size, sizeof(buffer_t));
+            taken++;
+        }
+        first->free_buffers = buf;
+        first->live += taken;
+        if(buf == NULL)
+            unlink_page(top, first); // page is full now
+        else
+            update_bucket(top, first);
+        stats_blocks(&stats, size_class, -taken, top->size);
+    }
+    return i;
+}
+
+/*
+ * Pages the batch empties are taken off the list of their size right
+ * away, chained through next_page, and only given back to kpage, and the
+ * control page with them, once the whole batch is in.
+ */
 void
-free_page_from_list(buffer_t* size_buf, kpage_t* page)
+kma_free_batch(void** ptrs, kma_size_t size, int n)
 {
-    buffer_t* prev = size_buf;
-    buffer_t* top = size_buf->next_buffer;
-    while(top != NULL)
+    int size_class = choose_class(size);
+    int i;
+    if(n <= 0)
+        return;
+    if(size_class == -1)
+    {
+        for(i = 0; i < n; i++)
+            kma_free(ptrs[i], size);
+        return;
+    }
+    size_header_t* top = &size_table->sizes[size_class];
+    buffer_t* empty = NULL;
+    for(i = 0; i < n; i++)
     {
-        if(top->page == page)
+        buffer_t* buf = (buffer_t*)(ptrs[i] - sizeof(buffer_t));
+        buffer_t* first = BASEADDR(buf);
+        int was_full = (first->free_buffers == NULL);
+        buf->next_buffer = first->free_buffers;
+        first->free_buffers = buf;
+        stats_free(&stats, size_class, size, top->size, sizeof(buffer_t));
+        if(--first->live != 0)
         {
-            while(top != NULL && top->page == page)
-            {
-                top = top->next_buffer;
-            }
-            if(top != NULL)
-            {
-                prev->next_buffer = top;
-                prev = top;
-                top = top->next_buffer;
-            }
+            if(was_full)
+                link_page(top, first);
             else
-                prev->next_buffer = NULL;
+                update_bucket(top, first);
         }
         else
         {
-            prev = top;
-            top = top->next_buffer;
+            if(!was_full)
+                unlink_page(top, first);
+            first->next_page = empty;
+            empty = first;
         }
     }
-    size_table->next_buffer->size--;
-    free_page(page);
+    stats_blocks(&stats, size_class, n, top->size);
+    while(empty != NULL)
+    {
+        buffer_t* first = empty;
+        empty = first->next_page;
+        size_table->num_pages--;
+        stats.classes[size_class].pages--;
+        stats_blocks(&stats, size_class, -(PAGESIZE / top->size), top->size);
+        cache_free_page(&page_cache, first->page);
+    }
+    if(size_table->num_pages == 0)
+        deinit_size_table();
 }
 
-int
-last_buf_in_page(buffer_t* size_buf, kpage_t* page)
+/* The page cache empties by itself once every page is freed */
+void
+kma_drain(void)
 {
-    buffer_t* top = size_buf->next_buffer;
-    kma_size_t used_buffs_size = 0;
-    while(top != NULL)
-    {
-        if(top->page == page)
-            used_buffs_size += size_buf->size;
-        top = top->next_buffer;
-    }
-    if (used_buffs_size >= PAGESIZE)
-        return 1;
-    return 0;
+}
+
+kma_stats_t*
+kma_stats(void)
+{
+    return &stats;
 }
 
 
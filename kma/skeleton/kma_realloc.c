@@ -0,0 +1,76 @@
+/***************************************************************************
+ *  Title: Reallocation
+ * -------------------------------------------------------------------------
+ *    Purpose: kma_realloc and kma_calloc for every allocator, built on
+ *             its kma_malloc, kma_free, kma_resize and kma_zeroed
+ *    File: kma_realloc.c
+ ***************************************************************************/
+
+/************System include***********************************************/
+#include <limits.h>
+#include <string.h>
+
+/************Private include**********************************************/
+#include "kpage.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void*
+kma_realloc(void* ptr, kma_size_t old_size, kma_size_t new_size)
+{
+  void* res;
+
+  if (ptr == NULL)
+    {
+      return kma_malloc(new_size);
+    }
+  if (new_size == 0)
+    {
+      kma_free(ptr, old_size);
+      return NULL;
+    }
+  if (kma_resize(ptr, old_size, new_size))
+    {
+      return ptr;
+    }
+
+  res = kma_malloc(new_size);
+  if (res == NULL)
+    {
+      return NULL;
+    }
+  memcpy(res, ptr, (old_size < new_size) ? old_size : new_size);
+  kma_free(ptr, old_size);
+  return res;
+}
+
+void*
+kma_calloc(kma_size_t n, kma_size_t size)
+{
+  void* res;
+
+  if (n < 0 || size < 0 || (size != 0 && n > INT_MAX / size))
+    {
+      return NULL;
+    }
+  res = kma_malloc(n * size);
+  if (res != NULL && !kma_zeroed(res, n * size))
+    {
+      memset(res, 0, n * size);
+    }
+  return res;
+}
@@ -45,6 +45,8 @@
 /************Private include**********************************************/
 #include "kpage.h"
 #include "kma.h"
+#include "kma_stats.h"
+#include "kma_cache.h"
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -53,10 +55,54 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+/*
+ * Every free extent is a node of an address-ordered treap that lives in the
+ * free memory itself. Each node also caches the largest extent in its
+ * subtree so that first-fit can be answered in O(log n) without walking the
+ * list. The treap priority is a hash of the node address, so no extra field
+ * is needed.
+ *
+ * Allocated extents carry no header at all: kma_free gets the size back and
+ * rounds it the same way kma_malloc did. Pages carry no header either: once
+ * a page is one free extent again its kpage_t comes from page_descriptor.
+ * Requests larger than a page get a run of pages of their own.
+ */
+
+typedef struct extentT
+{
+    struct extentT* left;
+    struct extentT* right;
+    kma_size_t size;
+    kma_size_t max; // largest size in this subtree
+} extent_t;
+
+#define GRANULE 8
+
+#define MINEXTENT ((kma_size_t)sizeof(extent_t))
+
+#define USABLE PAGESIZE
+
 /************Global Variables*********************************************/
+static extent_t* free_map = NULL;
 
-/************Function Prototypes******************************************/
+// extents of any multiple of GRANULE, then runs of pages
+static kma_stats_t stats = { 2, { { GRANULE }, { 0 } } };
+static page_cache_t page_cache = { PAGECACHE_LOW, PAGECACHE_HIGH, &stats };
 
+/************Function Prototypes******************************************/
+kma_size_t round_extent_size(kma_size_t);
+unsigned int priority(extent_t*);
+void update_max(extent_t*);
+extent_t* rotate_left(extent_t*);
+extent_t* rotate_right(extent_t*);
+extent_t* insert_extent(extent_t*, extent_t*);
+extent_t* remove_extent(extent_t*, extent_t*);
+extent_t* join_extents(extent_t*, extent_t*);
+extent_t* update_path(extent_t*, extent_t*);
+extent_t* first_fit(kma_size_t);
+extent_t* find_neighbour(void*, int);
+void release_extent(void*, kma_size_t);
+int add_new_page(void);
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
@@ -64,13 +110,402 @@
 void*
 kma_malloc(kma_size_t size)
 {
-  return NULL;
+    kma_size_t need = round_extent_size(size);
+    if(need == -1)
+    {
+        stats.classes[1].pages += NUMPAGES(size);
+        stats_alloc(&stats, 1, size, NUMPAGES(size) * PAGESIZE, 0);
+        return cache_get_pages(&page_cache, NUMPAGES(size))->ptr;
+    }
+    extent_t* extent = first_fit(need);
+    if(extent == NULL)
+    {
+        if(add_new_page() == -1)
+            return NULL;
+        extent = first_fit(need);
+    }
+    assert(extent != NULL);
+    stats_alloc(&stats, 0, size, need, 0);
+    stats.free_bytes -= need;
+
+    if(extent->size == need)
+    {
+        free_map = remove_extent(free_map, extent);
+        stats.classes[0].free--;
+        return (void*)extent;
+    }
+    // carve from the back so the extent keeps its address (and tree slot)
+    stats.classes[0].splits++;
+    extent->size -= need;
+    free_map = update_path(free_map, extent);
+    return (void*)extent + extent->size;
+}
+
+/* Round a request up to the extent size it will occupy. A leftover smaller
+ * than MINEXTENT could never hold a tree node, so requests that would leave
+ * one in a fresh page take the whole page. Returns -1 if it needs a run of
+ * pages.
+ */
+kma_size_t
+round_extent_size(kma_size_t size)
+{
+    if(size > USABLE)
+        return -1;
+    if(size < MINEXTENT)
+        size = MINEXTENT;
+    size = (size + GRANULE - 1) & ~(GRANULE - 1);
+    if(size > USABLE - MINEXTENT)
+        size = USABLE;
+    return size;
+}
+
+/* Get a page and hand all of it to the resource map as one extent */
+int
+add_new_page(void)
+{
+    kpage_t* page = cache_get_page(&page_cache);
+    if(page == NULL)
+        return -1;
+    extent_t* extent = (extent_t*)page->ptr;
+    extent->left = NULL;
+    extent->right = NULL;
+    extent->size = USABLE;
+    extent->max = USABLE;
+    free_map = insert_extent(free_map, extent);
+    stats.classes[0].pages++;
+    stats_blocks(&stats, 0, 1, USABLE);
+    return 0;
+}
+
+/* Lowest addressed extent with at least need bytes. An extent that would
+ * leave a remainder too small to track is skipped by retrying with room for
+ * a whole extent to spare.
+ */
+extent_t*
+first_fit(kma_size_t need)
+{
+    kma_size_t want = need;
+    int pass;
+    for(pass = 0; pass < 2; pass++)
+    {
+        extent_t* node = free_map;
+        if(node == NULL || node->max < want)
+            return NULL;
+        while(node != NULL)
+        {
+            if(node->left != NULL && node->left->max >= want)
+                node = node->left;
+            else if(node->size >= want)
+                break;
+            else
+                node = node->right;
+        }
+        assert(node != NULL);
+        if(node->size == need || node->size >= need + MINEXTENT)
+            return node;
+        want = need + MINEXTENT;
+    }
+    return NULL;
+}
+
+unsigned int
+priority(extent_t* node)
+{
+    return (unsigned int)(((unsigned long)node >> 3) * 2654435761u);
+}
+
+void
+update_max(extent_t* node)
+{
+    node->max = node->size;
+    if(node->left != NULL && node->left->max > node->max)
+        node->max = node->left->max;
+    if(node->right != NULL && node->right->max > node->max)
+        node->max = node->right->max;
+}
+
+extent_t*
+rotate_left(extent_t* node)
+{
+    extent_t* top = node->right;
+    node->right = top->left;
+    top->left = node;
+    update_max(node);
+    update_max(top);
+    return top;
+}
+
+extent_t*
+rotate_right(extent_t* node)
+{
+    extent_t* top = node->left;
+    node->left = top->right;
+    top->right = node;
+    update_max(node);
+    update_max(top);
+    return top;
+}
+
+extent_t*
+insert_extent(extent_t* root, extent_t* node)
+{
+    if(root == NULL)
+    {
+        node->left = NULL;
+        node->right = NULL;
+        update_max(node);
+        return node;
+    }
+    if(node < root)
+    {
+        root->left = insert_extent(root->left, node);
+        if(priority(root->left) > priority(root))
+            return rotate_right(root);
+    }
+    else
+    {
+        root->right = insert_extent(root->right, node);
+        if(priority(root->right) > priority(root))
+            return rotate_left(root);
+    }
+    update_max(root);
+    return root;
+}
+
+/* Merge two treaps where every node of left lies below every node of right */
+extent_t*
+join_extents(extent_t* left, extent_t* right)
+{
+    if(left == NULL)
+        return right;
+    if(right == NULL)
+        return left;
+    if(priority(left) > priority(right))
+    {
+        left->right = join_extents(left->right, right);
+        update_max(left);
+        return left;
+    }
+    right->left = join_extents(left, right->left);
+    update_max(right);
+    return right;
+}
+
+extent_t*
+remove_extent(extent_t* root, extent_t* node)
+{
+    assert(root != NULL);
+    if(root == node)
+        return join_extents(root->left, root->right);
+    if(node < root)
+        root->left = remove_extent(root->left, node);
+    else
+        root->right = remove_extent(root->right, node);
+    update_max(root);
+    return root;
+}
+
+/* node changed size in place, refresh the cached maxima above it */
+extent_t*
+update_path(extent_t* root, extent_t* node)
+{
+    if(node < root)
+        root->left = update_path(root->left, node);
+    else if(node > root)
+        root->right = update_path(root->right, node);
+    update_max(root);
+    return root;
+}
+
+/* Closest extent below (direction < 0) or above (direction > 0) ptr */
+extent_t*
+find_neighbour(void* ptr, int direction)
+{
+    extent_t* best = NULL;
+    extent_t* node = free_map;
+    while(node != NULL)
+    {
+        if(direction < 0)
+        {
+            if((void*)node < ptr)
+            {
+                best = node;
+                node = node->right;
+            }
+            else
+                node = node->left;
+        }
+        else
+        {
+            if((void*)node > ptr)
+            {
+                best = node;
+                node = node->left;
+            }
+            else
+                node = node->right;
+        }
+    }
+    return best;
 }
 
 void
 kma_free(void* ptr, kma_size_t size)
 {
-  ;
+    kma_size_t length = round_extent_size(size);
+    if(length == -1)
+    {
+        stats.classes[1].pages -= NUMPAGES(size);
+        stats_free(&stats, 1, size, NUMPAGES(size) * PAGESIZE, 0);
+        cache_free_pages(&page_cache, page_descriptor(ptr));
+        return;
+    }
+    stats_free(&stats, 0, size, length, 0);
+    release_extent(ptr, length);
+}
+
+/*
+ * Give the extent back to the map, merging it with the free extents right
+ * before and after it. Pages have no header, so the last extent of one page
+ * can touch the first extent of the next; those are never merged, which
+ * keeps every extent inside one page. If the merged extent is the whole page
+ * the page goes back to kpage.
+ */
+void
+release_extent(void* ptr, kma_size_t length)
+{
+    extent_t* prev = find_neighbour(ptr, -1);
+    extent_t* next = find_neighbour(ptr, 1);
+    extent_t* merged;
+    stats_blocks(&stats, 0, 1, length);
+
+    if(next != NULL && ptr + length == (void*)next
+       && BASEADDR(next) == BASEADDR(ptr))
+    {
+        length += next->size;
+        free_map = remove_extent(free_map, next);
+        stats.classes[0].free--;
+        stats.classes[0].coalesces++;
+    }
+    if(prev != NULL && (void*)prev + prev->size == ptr
+       && BASEADDR(prev) == BASEADDR(ptr))
+    {
+        prev->size += length;
+        free_map = update_path(free_map, prev);
+        merged = prev;
+        stats.classes[0].free--;
+        stats.classes[0].coalesces++;
+    }
+    else
+    {
+        merged = (extent_t*)ptr;
+        merged->size = length;
+        free_map = insert_extent(free_map, merged);
+    }
+
+    if(merged->size == USABLE)
+    {
+        assert((void*)merged == BASEADDR(merged));
+        free_map = remove_extent(free_map, merged);
+        stats.classes[0].pages--;
+        stats_blocks(&stats, 0, -1, USABLE);
+        cache_free_page(&page_cache, page_descriptor(merged));
+    }
+}
+
+/*
+ * Grow into the front of the free extent right after the extent, or give
+ * its tail back to the map. A tail too small to track on its own can only
+ * go if it joins a free extent after it. Runs stay where they are if they
+ * need as many pages.
+ */
+int
+kma_resize(void* ptr, kma_size_t old_size, kma_size_t new_size)
+{
+    kma_size_t length = round_extent_size(old_size);
+    kma_size_t need = round_extent_size(new_size);
+    if(length == -1 || need == -1)
+    {
+        if(length != need || NUMPAGES(old_size) != NUMPAGES(new_size))
+            return FALSE;
+        kma_size_t run = NUMPAGES(old_size) * PAGESIZE;
+        stats_free(&stats, 1, old_size, run, 0);
+        stats_alloc(&stats, 1, new_size, run, 0);
+        return TRUE;
+    }
+
+    extent_t* next = find_neighbour(ptr, 1);
+    if(next != NULL
+       && (ptr + length != (void*)next || BASEADDR(next) != BASEADDR(ptr)))
+        next = NULL;
+    if(need > length)
+    {
+        kma_size_t grow = need - length;
+        if(next == NULL || next->size < grow
+           || (next->size > grow && next->size - grow < MINEXTENT))
+            return FALSE;
+        free_map = remove_extent(free_map, next);
+        if(next->size == grow)
+            stats.classes[0].free--;
+        else
+        {
+            extent_t* rest = (void*)next + grow;
+            rest->size = next->size - grow;
+            free_map = insert_extent(free_map, rest);
+            stats.classes[0].splits++;
+        }
+        stats.free_bytes -= grow;
+    }
+    else if(need < length)
+    {
+        if(length - need < MINEXTENT && next == NULL)
+            return FALSE;
+        release_extent(ptr + need, length - need);
+    }
+    stats_free(&stats, 0, old_size, length, 0);
+    stats_alloc(&stats, 0, new_size, need, 0);
+    return TRUE;
+}
+
+/* Only runs come straight from kpage, extents have held tree nodes */
+int
+kma_zeroed(void* ptr, kma_size_t size)
+{
+    return round_extent_size(size) == -1 && page_descriptor(ptr)->zero;
+}
+
+/* Every extent is cut from the map on its own, so a batch is a loop */
+int
+kma_malloc_batch(kma_size_t size, int n, void** out)
+{
+    int i;
+    for(i = 0; i < n; i++)
+    {
+        out[i] = kma_malloc(size);
+        if(out[i] == NULL)
+            break;
+    }
+    return i;
+}
+
+void
+kma_free_batch(void** ptrs, kma_size_t size, int n)
+{
+    int i;
+    for(i = 0; i < n; i++)
+        kma_free(ptrs[i], size);
+}
+
+/* The page cache empties by itself once every page is freed */
+void
+kma_drain(void)
+{
+}
+
+kma_stats_t*
+kma_stats(void)
+{
+    return &stats;
 }
 
 #endif // KMA_RM
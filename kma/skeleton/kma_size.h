@@ -0,0 +1,120 @@
+/***************************************************************************
+ *  Title: Size Classes
+ * -------------------------------------------------------------------------
+ *    Purpose: Constant time mapping from request sizes to the
+ *             power-of-two and quarter power-of-two size classes used
+ *             by the allocators
+ *    File: kma_size.h
+ ***************************************************************************/
+
+#ifndef __KMA_SIZE_H__
+#define __KMA_SIZE_H__
+
+/************System include***********************************************/
+
+/************Private include**********************************************/
+#include "kpage.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#define PAGESHIFT 13
+
+#if (1 << PAGESHIFT) != PAGESIZE
+#error "PAGESHIFT does not match PAGESIZE"
+#endif
+
+/***********************************************************************
+ *  Title: Number of size classes
+ * ---------------------------------------------------------------------
+ *    Purpose: Count the power-of-two sizes from 1 << minshift up to
+ *             and including PAGESIZE, at compile time
+ *    Input: log2 of the smallest block size
+ *    Output: the number of size classes
+ ***********************************************************************/
+#define NUMSIZES(minshift) (PAGESHIFT - (minshift) + 1)
+
+/***********************************************************************
+ *  Title: Number of quarter size classes
+ * ---------------------------------------------------------------------
+ *    Purpose: Count the sizes of size_to_quarter_class up to and
+ *             including 1 << maxshift, at compile time
+ *    Input: log2 of the largest block size, at least 6
+ *    Output: the number of size classes
+ ***********************************************************************/
+#define NUMQUARTERS(maxshift) (4 + 4 * ((maxshift) - 6))
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+
+/***********************************************************************
+ *  Title: Size class of a request
+ * ---------------------------------------------------------------------
+ *    Purpose: Find the smallest power-of-two block of at least
+ *             1 << minshift bytes that holds size bytes, using a count
+ *             leading zeros instead of a doubling loop
+ *    Input: the size in bytes, log2 of the smallest block size
+ *    Output: the class index, so the block size is 1 << (minshift +
+ *            index); indexes of NUMSIZES(minshift) and up are larger
+ *            than a page
+ ***********************************************************************/
+static inline int
+size_to_class(kma_size_t size, int minshift)
+{
+  if (size <= (1 << minshift))
+    {
+      return 0;
+    }
+  return (32 - __builtin_clz((unsigned int) (size - 1))) - minshift;
+}
+
+/***********************************************************************
+ *  Title: Quarter size class of a request
+ * ---------------------------------------------------------------------
+ *    Purpose: Find the smallest block that holds size bytes among
+ *             16, 32, 48 and 64 and then four sizes between any two
+ *             powers of two (80, 96, 112, 128, 160, ...), so a block
+ *             is at most a quarter larger than its request
+ *    Input: the size in bytes
+ *    Output: the class index, see quarter_class_size
+ ***********************************************************************/
+static inline int
+size_to_quarter_class(kma_size_t size)
+{
+  if (size <= 64)
+    {
+      return (size <= 0) ? 0 : (size - 1) / 16;
+    }
+  int k = 31 - __builtin_clz((unsigned int) (size - 1));
+  return 4 + (k - 6) * 4 + ((size - 1 - (1 << k)) >> (k - 2));
+}
+
+/***********************************************************************
+ *  Title: Block size of a quarter size class
+ * ---------------------------------------------------------------------
+ *    Purpose: Undo size_to_quarter_class
+ *    Input: the class index
+ *    Output: the block size of the class
+ ***********************************************************************/
+static inline kma_size_t
+quarter_class_size(int size_class)
+{
+  if (size_class < 4)
+    {
+      return 16 * (size_class + 1);
+    }
+  int k = 6 + (size_class - 4) / 4;
+  return (1 << k) + ((size_class - 4) % 4 + 1) * (1 << (k - 2));
+}
+
+/************External Declaration*****************************************/
+
+/**************Definition***************************************************/
+
+#endif /* __KMA_SIZE_H__ */
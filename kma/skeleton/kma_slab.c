@@ -0,0 +1,524 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Kernel memory allocator based on the slab allocator
+ *             (object caches)
+ *    File: kma_slab.c
+ ***************************************************************************/
+#ifdef KMA_SLAB
+#define __KMA_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/************Private include**********************************************/
+#include "kpage.h"
+#include "kma.h"
+#include "kma_size.h"
+#include "kma_slab.h"
+#include "kma_stats.h"
+#include "kma_cache.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/*
+ * A slab is a run of one to MAXSLABPAGES pages: as few as leave at most
+ * 1/SLABWASTE of it unused, or the least wasteful if none does. It starts
+ * with a slab_t followed by an array of free list indexes, one per object,
+ * so the free list never writes into the objects and they stay constructed
+ * while free. The objects come after that, shifted by the slab's colour:
+ * consecutive slabs start their objects CACHELINE bytes apart (as far as
+ * the leftover space allows) so that objects at the same index don't all
+ * fall on the same cache lines. An object finds its slab_t at the start
+ * of its page, or of its run through page_descriptor.
+ *
+ * A cache keeps its slabs on a full, a partial and an empty list, and one
+ * empty slab, so that a cache going back and forth between none and a few
+ * objects doesn't get and construct a slab every time. Further empty slabs
+ * go back to kpage; kma_drain gives back the last ones of the general
+ * caches too.
+ *
+ * kma_malloc is served by general caches of powers of two from 16 to
+ * MAXGENERAL bytes, larger requests get a run of whole pages. The general
+ * caches are created on the first request and only destroyed by kma_drain,
+ * when none of them holds an object.
+ */
+
+#define CACHELINE 64
+
+#define MINALIGN 8
+
+#define MAXGENERAL (PAGESIZE / 2)
+
+#define MINSHIFT 4
+
+#define NUMGENERAL (NUMSIZES(MINSHIFT) - 1) // 16, ..., MAXGENERAL
+
+#define MAXSLABPAGES 4
+
+#define SLABWASTE 4
+
+#define ENDOFLIST 0xFFFF
+
+typedef struct slabT
+{
+    struct kma_cacheT* cache;
+    kpage_t* page;
+    struct slabT* next;
+    struct slabT* prev;
+    void* objects;
+    int in_use;
+    int free;
+    unsigned short free_next[];
+} slab_t;
+
+struct kma_cacheT
+{
+    char name[32];
+    kma_size_t size;
+    kma_size_t buffer_size; // size rounded up to the alignment
+    kma_size_t align;
+    kma_ctor_t ctor;
+    kma_ctor_t dtor;
+    int slab_pages;
+    int num_objects;        // per slab
+    kma_size_t header_size; // slab_t and free list, aligned
+    kma_size_t colour_max;
+    kma_size_t colour_next;
+    slab_t* full;
+    slab_t* partial;
+    slab_t* empty;
+    int num_empty;
+    int stat_class;         // general cache number, -1 for other caches
+};
+
+/************Global Variables*********************************************/
+static kma_cache_t cache_cache; // the cache of kma_cache_t
+static kma_cache_t* general[NUMGENERAL];
+
+// the general caches, then runs of pages; slabs of other caches are all
+// header as far as kma_malloc is concerned
+static kma_stats_t stats = { NUMGENERAL + 1 };
+static page_cache_t page_cache = { PAGECACHE_LOW, PAGECACHE_HIGH, &stats };
+
+/************Function Prototypes******************************************/
+void init_cache(kma_cache_t*, char*, kma_size_t, kma_size_t,
+		kma_ctor_t, kma_ctor_t);
+void layout_cache(kma_cache_t*, int);
+slab_t* find_slab(kma_cache_t*, void*);
+void reap_cache(kma_cache_t*);
+slab_t* new_slab(kma_cache_t*);
+void destroy_slab(kma_cache_t*, slab_t*);
+void push_slab(slab_t**, slab_t*);
+void unlink_slab(slab_t**, slab_t*);
+void init_general(void);
+void deinit_general(void);
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+/* Lay out a cache on the fewest pages that waste little enough */
+void
+init_cache(kma_cache_t* cache, char* name, kma_size_t size, kma_size_t align,
+	   kma_ctor_t ctor, kma_ctor_t dtor)
+{
+    memset(cache, 0, sizeof(kma_cache_t));
+    strncpy(cache->name, name, sizeof(cache->name) - 1);
+    if(align < MINALIGN)
+        align = MINALIGN;
+    cache->size = size;
+    cache->align = align;
+    cache->buffer_size = (size + align - 1) & ~(align - 1);
+    cache->ctor = ctor;
+    cache->dtor = dtor;
+    cache->stat_class = -1;
+
+    int pages;
+    int best = 1;
+    double best_waste = 1;
+    for(pages = 1; pages <= MAXSLABPAGES; pages++)
+    {
+        layout_cache(cache, pages);
+        if(cache->num_objects == 0)
+            continue;
+        double waste = (double) cache->colour_max / (pages * PAGESIZE);
+        if(waste * SLABWASTE <= 1)
+            return;
+        if(waste < best_waste)
+        {
+            best = pages;
+            best_waste = waste;
+        }
+    }
+    layout_cache(cache, best);
+}
+
+/* As many objects as fit the pages next to their slab_t and free list
+ * entries, with what is left over used for colouring
+ */
+void
+layout_cache(kma_cache_t* cache, int pages)
+{
+    kma_size_t slab_size = pages * PAGESIZE;
+    kma_size_t align = cache->align;
+    int n = (slab_size - sizeof(slab_t)) / (cache->buffer_size + sizeof(short));
+    kma_size_t header = 0;
+    if(n >= ENDOFLIST)
+        n = ENDOFLIST - 1;
+    while(n > 0)
+    {
+        header = sizeof(slab_t) + n * sizeof(short);
+        header = (header + align - 1) & ~(align - 1);
+        if(header + n * cache->buffer_size <= slab_size)
+            break;
+        n--;
+    }
+    cache->slab_pages = pages;
+    cache->num_objects = n;
+    cache->header_size = header;
+    cache->colour_max = n > 0 ? slab_size - header - n * cache->buffer_size : 0;
+}
+
+kma_cache_t*
+kma_cache_create(char* name, kma_size_t size, kma_size_t align,
+		 kma_ctor_t ctor, kma_ctor_t dtor)
+{
+    if(cache_cache.num_objects == 0)
+        init_cache(&cache_cache, "kma_cache", sizeof(kma_cache_t), 0,
+                   NULL, NULL);
+    kma_cache_t* cache = kma_cache_alloc(&cache_cache);
+    if(cache == NULL)
+        return NULL;
+    init_cache(cache, name, size, align, ctor, dtor);
+    if(cache->num_objects == 0)
+    {
+        kma_cache_free(&cache_cache, cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void
+kma_cache_destroy(kma_cache_t* cache)
+{
+    assert(cache->full == NULL && cache->partial == NULL);
+    reap_cache(cache);
+    kma_cache_free(&cache_cache, cache);
+}
+
+/* Give back every empty slab */
+void
+reap_cache(kma_cache_t* cache)
+{
+    while(cache->empty != NULL)
+        destroy_slab(cache, cache->empty);
+}
+
+/* Take an object from the first partial slab, or an empty one */
+void*
+kma_cache_alloc(kma_cache_t* cache)
+{
+    slab_t* slab = cache->partial;
+    if(slab == NULL)
+    {
+        slab = cache->empty;
+        if(slab != NULL)
+        {
+            unlink_slab(&cache->empty, slab);
+            cache->num_empty--;
+        }
+        else
+        {
+            slab = new_slab(cache);
+            if(slab == NULL)
+                return NULL;
+        }
+        push_slab(&cache->partial, slab);
+    }
+
+    int index = slab->free;
+    slab->free = slab->free_next[index];
+    slab->in_use++;
+    if(slab->free == ENDOFLIST)
+    {
+        unlink_slab(&cache->partial, slab);
+        push_slab(&cache->full, slab);
+    }
+    if(cache->stat_class != -1)
+        stats_blocks(&stats, cache->stat_class, -1, cache->buffer_size);
+    return slab->objects + index * cache->buffer_size;
+}
+
+void
+kma_cache_free(kma_cache_t* cache, void* obj)
+{
+    slab_t* slab = find_slab(cache, obj);
+    assert(slab->cache == cache);
+    int index = (obj - slab->objects) / cache->buffer_size;
+
+    if(slab->free == ENDOFLIST)
+    {
+        unlink_slab(&cache->full, slab);
+        push_slab(&cache->partial, slab);
+    }
+    slab->free_next[index] = slab->free;
+    slab->free = index;
+    slab->in_use--;
+    if(cache->stat_class != -1)
+        stats_blocks(&stats, cache->stat_class, 1, cache->buffer_size);
+
+    if(slab->in_use == 0)
+    {
+        unlink_slab(&cache->partial, slab);
+        push_slab(&cache->empty, slab);
+        cache->num_empty++;
+        if(cache->num_empty > 1)
+            destroy_slab(cache, slab);
+    }
+}
+
+slab_t*
+find_slab(kma_cache_t* cache, void* obj)
+{
+    if(cache->slab_pages == 1)
+        return BASEADDR(obj);
+    return page_descriptor(obj)->ptr;
+}
+
+/* Get pages, give them the next colour and construct all of their objects */
+slab_t*
+new_slab(kma_cache_t* cache)
+{
+    kpage_t* page = cache_get_pages(&page_cache, cache->slab_pages);
+    if(page == NULL)
+        return NULL;
+    slab_t* slab = page->ptr;
+    slab->cache = cache;
+    slab->page = page;
+    slab->in_use = 0;
+    slab->objects = page->ptr + cache->header_size + cache->colour_next;
+    cache->colour_next += CACHELINE > cache->align ? CACHELINE : cache->align;
+    if(cache->colour_next > cache->colour_max)
+        cache->colour_next = 0;
+
+    int i;
+    for(i = 0; i < cache->num_objects; i++)
+    {
+        slab->free_next[i] = (i + 1 < cache->num_objects) ? i + 1 : ENDOFLIST;
+        if(cache->ctor != NULL)
+            cache->ctor(slab->objects + i * cache->buffer_size, cache->size);
+    }
+    slab->free = 0;
+
+    int n = cache->num_objects;
+    kma_size_t slab_size = cache->slab_pages * PAGESIZE;
+    if(cache->stat_class == -1)
+        stats.header_bytes += slab_size;
+    else
+    {
+        stats.classes[cache->stat_class].pages += cache->slab_pages;
+        stats.header_bytes += slab_size - n * cache->buffer_size;
+        stats_blocks(&stats, cache->stat_class, n, cache->buffer_size);
+    }
+    return slab;
+}
+
+/* Destroy the objects of an empty slab and give its pages back */
+void
+destroy_slab(kma_cache_t* cache, slab_t* slab)
+{
+    assert(slab->in_use == 0);
+    unlink_slab(&cache->empty, slab);
+    cache->num_empty--;
+    if(cache->dtor != NULL)
+    {
+        int i;
+        for(i = 0; i < cache->num_objects; i++)
+            cache->dtor(slab->objects + i * cache->buffer_size, cache->size);
+    }
+
+    int n = cache->num_objects;
+    kma_size_t slab_size = cache->slab_pages * PAGESIZE;
+    if(cache->stat_class == -1)
+        stats.header_bytes -= slab_size;
+    else
+    {
+        stats.classes[cache->stat_class].pages -= cache->slab_pages;
+        stats.header_bytes -= slab_size - n * cache->buffer_size;
+        stats_blocks(&stats, cache->stat_class, -n, cache->buffer_size);
+    }
+    cache_free_pages(&page_cache, slab->page);
+}
+
+void
+push_slab(slab_t** list, slab_t* slab)
+{
+    slab->next = *list;
+    slab->prev = NULL;
+    if(*list != NULL)
+        (*list)->prev = slab;
+    *list = slab;
+}
+
+void
+unlink_slab(slab_t** list, slab_t* slab)
+{
+    if(slab->prev != NULL)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+    if(slab->next != NULL)
+        slab->next->prev = slab->prev;
+}
+
+void
+init_general(void)
+{
+    int i;
+    for(i = 0; i < NUMGENERAL; i++)
+    {
+        general[i] = kma_cache_create("kma_malloc", 1 << (MINSHIFT + i), 0,
+                                      NULL, NULL);
+        assert(general[i] != NULL);
+        general[i]->stat_class = i;
+        stats.classes[i].size = general[i]->buffer_size;
+    }
+}
+
+void
+deinit_general(void)
+{
+    int i;
+    for(i = 0; i < NUMGENERAL; i++)
+    {
+        kma_cache_destroy(general[i]);
+        general[i] = NULL;
+    }
+}
+
+void*
+kma_malloc(kma_size_t size)
+{
+    if(size > MAXGENERAL)
+    {
+        stats.classes[NUMGENERAL].pages += NUMPAGES(size);
+        stats_alloc(&stats, NUMGENERAL, size, NUMPAGES(size) * PAGESIZE, 0);
+        return cache_get_pages(&page_cache, NUMPAGES(size))->ptr;
+    }
+    if(general[0] == NULL)
+        init_general();
+    int size_class = size_to_class(size, MINSHIFT);
+    void* ptr = kma_cache_alloc(general[size_class]);
+    if(ptr != NULL)
+    {
+        stats_alloc(&stats, size_class, size, general[size_class]->buffer_size,
+                    0);
+    }
+    return ptr;
+}
+
+void
+kma_free(void* ptr, kma_size_t size)
+{
+    if(size > MAXGENERAL)
+    {
+        stats.classes[NUMGENERAL].pages -= NUMPAGES(size);
+        stats_free(&stats, NUMGENERAL, size, NUMPAGES(size) * PAGESIZE, 0);
+        cache_free_pages(&page_cache, page_descriptor(ptr));
+        return;
+    }
+    int size_class = size_to_class(size, MINSHIFT);
+    stats_free(&stats, size_class, size, general[size_class]->buffer_size, 0);
+    kma_cache_free(general[size_class], ptr);
+}
+
+/* Within a general cache, or a run of the same number of pages, nothing
+ * moves
+ */
+int
+kma_resize(void* ptr, kma_size_t old_size, kma_size_t new_size)
+{
+    if(old_size > MAXGENERAL || new_size > MAXGENERAL)
+    {
+        if(old_size <= MAXGENERAL || new_size <= MAXGENERAL
+           || NUMPAGES(old_size) != NUMPAGES(new_size))
+            return FALSE;
+        kma_size_t run = NUMPAGES(old_size) * PAGESIZE;
+        stats_free(&stats, NUMGENERAL, old_size, run, 0);
+        stats_alloc(&stats, NUMGENERAL, new_size, run, 0);
+        return TRUE;
+    }
+    int size_class = size_to_class(old_size, MINSHIFT);
+    if(size_class != size_to_class(new_size, MINSHIFT))
+        return FALSE;
+    kma_size_t block = general[size_class]->buffer_size;
+    stats_free(&stats, size_class, old_size, block, 0);
+    stats_alloc(&stats, size_class, new_size, block, 0);
+    return TRUE;
+}
+
+/* Only runs come straight from kpage, objects may have been used before */
+int
+kma_zeroed(void* ptr, kma_size_t size)
+{
+    return size > MAXGENERAL && page_descriptor(ptr)->zero;
+}
+
+/* One object at a time from the general cache of the size */
+int
+kma_malloc_batch(kma_size_t size, int n, void** out)
+{
+    int i;
+    for(i = 0; i < n; i++)
+    {
+        out[i] = kma_malloc(size);
+        if(out[i] == NULL)
+            break;
+    }
+    return i;
+}
+
+void
+kma_free_batch(void** ptrs, kma_size_t size, int n)
+{
+    int i;
+    for(i = 0; i < n; i++)
+        kma_free(ptrs[i], size);
+}
+
+/* Reap the general caches, and destroy them once none holds an object, so
+ * that their descriptors don't hold on to a page either
+ */
+void
+kma_drain(void)
+{
+    int i;
+    int in_use = FALSE;
+    if(general[0] != NULL)
+    {
+        for(i = 0; i < NUMGENERAL; i++)
+        {
+            reap_cache(general[i]);
+            if(general[i]->full != NULL || general[i]->partial != NULL)
+                in_use = TRUE;
+        }
+        if(!in_use)
+            deinit_general();
+    }
+    reap_cache(&cache_cache);
+}
+
+kma_stats_t*
+kma_stats(void)
+{
+    return &stats;
+}
+
+#endif // KMA_SLAB
@@ -0,0 +1,81 @@
+/***************************************************************************
+ *  Title: Object Caches
+ * -------------------------------------------------------------------------
+ *    Purpose: Interface for the slab allocator's object caches
+ *    File: kma_slab.h
+ ***************************************************************************/
+
+#ifndef __KMA_SLAB_H__
+#define __KMA_SLAB_H__
+
+/************System include***********************************************/
+
+/************Private include**********************************************/
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+typedef struct kma_cacheT kma_cache_t;
+
+typedef void (*kma_ctor_t)(void* obj, kma_size_t size);
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+
+/***********************************************************************
+ *  Title: Creates an object cache
+ * ---------------------------------------------------------------------
+ *    Purpose: Creates a cache of objects of one size. Objects are
+ *             built by ctor when their slab is created and stay
+ *             constructed while they sit free in the cache; dtor runs
+ *             only when the slab goes back to the page allocator, which
+ *             for the last empty slab is on kma_cache_destroy
+ *    Input: a name for debugging, the object size, the alignment (a
+ *           power of two, 0 for the default), ctor and dtor (may be
+ *           NULL)
+ *    Output: the cache or NULL if objects of that size don't fit a slab
+ *            of four pages
+ ***********************************************************************/
+kma_cache_t* kma_cache_create(char* name, kma_size_t size, kma_size_t align,
+			      kma_ctor_t ctor, kma_ctor_t dtor);
+
+/***********************************************************************
+ *  Title: Allocates an object
+ * ---------------------------------------------------------------------
+ *    Purpose: Takes a constructed object from the cache
+ *    Input: the cache
+ *    Output: the object or NULL on failure
+ ***********************************************************************/
+void* kma_cache_alloc(kma_cache_t* cache);
+
+/***********************************************************************
+ *  Title: Frees an object
+ * ---------------------------------------------------------------------
+ *    Purpose: Gives an object back to its cache, which must be in its
+ *             constructed state again
+ *    Input: the cache, the object
+ *    Output: none
+ ***********************************************************************/
+void kma_cache_free(kma_cache_t* cache, void* obj);
+
+/***********************************************************************
+ *  Title: Destroys an object cache
+ * ---------------------------------------------------------------------
+ *    Purpose: Destroys all objects of the cache and releases its pages.
+ *             Every object must have been freed.
+ *    Input: the cache
+ *    Output: none
+ ***********************************************************************/
+void kma_cache_destroy(kma_cache_t* cache);
+
+/************External Declaration*****************************************/
+
+/**************Definition***************************************************/
+
+#endif /* __KMA_SLAB_H__ */
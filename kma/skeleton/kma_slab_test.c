@@ -0,0 +1,175 @@
+/***************************************************************************
+ *  Title: Object Cache Test
+ * -------------------------------------------------------------------------
+ *    Purpose: Checks the object caches of kma_slab.h: objects stay
+ *             constructed while free, the destructor runs when the
+ *             cache is destroyed, and the general caches keep their
+ *             slabs until kma_drain
+ *    File: kma_slab_test.c
+ ***************************************************************************/
+
+/************System include***********************************************/
+#include <stdlib.h>
+#include <stdio.h>
+
+/************Private include**********************************************/
+#include "kpage.h"
+#include "kma.h"
+#include "kma_slab.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#define CONSTRUCTED 0x5AB5AB
+
+#define NUMOBJECTS 200 // more than one slab of either size
+
+typedef struct
+{
+  int state;
+  int uses;
+} object_t;
+
+/************Global Variables*********************************************/
+static int g_constructed = 0;
+static int g_destructed = 0;
+static int g_failures = 0;
+
+/************Function Prototypes******************************************/
+void construct(void*, kma_size_t);
+void destruct(void*, kma_size_t);
+void check(int, char*);
+void test_cache(kma_size_t);
+void test_general(void);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  test_cache(sizeof(object_t));
+  test_cache(3000); // on slabs of more than a page
+  test_general();
+
+  check(page_stats()->num_in_use == 0, "every page is freed");
+  if (g_failures > 0)
+    {
+      printf("Test: FAILED\n");
+      return 1;
+    }
+  printf("Test: PASS\n");
+  return 0;
+}
+
+void
+construct(void* obj, kma_size_t size)
+{
+  ((object_t*) obj)->state = CONSTRUCTED;
+  ((object_t*) obj)->uses = 0;
+  g_constructed++;
+}
+
+void
+destruct(void* obj, kma_size_t size)
+{
+  if (((object_t*) obj)->state == CONSTRUCTED)
+    {
+      g_destructed++;
+    }
+}
+
+void
+check(int ok, char* what)
+{
+  if (!ok)
+    {
+      printf("failed: %s\n", what);
+      g_failures++;
+    }
+}
+
+/* Objects come back constructed, and with what their last user left in
+ * them, as long as their slab stays
+ */
+void
+test_cache(kma_size_t size)
+{
+  kma_cache_t* cache;
+  object_t* objs[NUMOBJECTS];
+  object_t* obj;
+  int constructed;
+  int i;
+
+  g_constructed = 0;
+  g_destructed = 0;
+  cache = kma_cache_create("test", size, 0, construct, destruct);
+  check(cache != NULL, "cache created");
+
+  for (i = 0; i < NUMOBJECTS; i++)
+    {
+      objs[i] = kma_cache_alloc(cache);
+      check(objs[i] != NULL && objs[i]->state == CONSTRUCTED,
+	    "new object constructed");
+      objs[i]->uses++;
+    }
+  constructed = g_constructed;
+  check(constructed >= NUMOBJECTS, "one constructor call per object");
+  check(g_destructed == 0, "no destructor call while allocated");
+
+  // the last empty slab stays, with its objects as they were freed
+  obj = objs[0];
+  kma_cache_free(cache, obj);
+  check(kma_cache_alloc(cache) == obj, "freed object handed out again");
+  check(obj->state == CONSTRUCTED && obj->uses == 1,
+	"object still constructed after free");
+  for (i = 0; i < NUMOBJECTS; i++)
+    {
+      kma_cache_free(cache, objs[i]);
+    }
+  obj = kma_cache_alloc(cache);
+  check(g_constructed == constructed, "empty slab kept");
+  check(obj->state == CONSTRUCTED && obj->uses == 1,
+	"object still constructed after emptying");
+  kma_cache_free(cache, obj);
+
+  kma_cache_destroy(cache);
+  check(g_destructed == g_constructed, "one destructor call per object");
+}
+
+/* Freeing the last object of the general caches keeps their slabs, until
+ * the allocator is drained
+ */
+void
+test_general(void)
+{
+  void* ptr;
+  int requested;
+
+  ptr = kma_malloc(100);
+  kma_free(ptr, 100);
+  requested = page_stats()->num_requested;
+  ptr = kma_malloc(100);
+  check(page_stats()->num_requested == requested,
+	"no page taken for the same size again");
+  kma_free(ptr, 100);
+
+  ptr = kma_malloc(PAGESIZE / 2);
+  check(ptr != NULL && ptr != BASEADDR(ptr),
+	"half a page served by a general cache");
+  kma_free(ptr, PAGESIZE / 2);
+
+  kma_drain();
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(-1);
+}
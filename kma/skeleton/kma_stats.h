@@ -0,0 +1,137 @@
+/***************************************************************************
+ *  Title: Allocator Statistics
+ * -------------------------------------------------------------------------
+ *    Purpose: Per size class statistics kept by every allocator, and
+ *             helpers to keep them up to date
+ *    File: kma_stats.h
+ ***************************************************************************/
+
+#ifndef __KMA_STATS_H__
+#define __KMA_STATS_H__
+
+/************System include***********************************************/
+
+/************Private include**********************************************/
+#include "kpage.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/*  Every byte of the pages in use is either requested by a live object or
+ *  counted in exactly one of header_bytes, rounding_bytes, free_bytes and
+ *  cached_bytes: headers are per block headers, page headers, control
+ *  pages and page space no block can use; rounding is the part of a live
+ *  block beyond its header and request; free is the free blocks held;
+ *  cached is the empty pages kept by kma_cache.h. Headers and rounding are
+ *  internal fragmentation, free space external.
+ *
+ *  The allocators update the counters as they go, so kma_stats only
+ *  returns a pointer and can be called after every operation.
+ */
+#define MAXSTATCLASSES 32
+
+typedef struct
+{
+  kma_size_t size; // block size, 0 for runs of whole pages
+  int live;        // blocks handed out
+  int free;        // free blocks held
+  int pages;       // pages held
+  int splits;
+  int coalesces;
+} kma_class_stat_t;
+
+typedef struct
+{
+  int num_classes;
+  kma_class_stat_t classes[MAXSTATCLASSES];
+  long header_bytes;
+  long rounding_bytes;
+  long free_bytes;
+  long cached_bytes;
+  int cache_hits; // pages taken from the cache rather than kpage
+} kma_stats_t;
+
+#if defined(KMA_MT) && defined(__KMA_IMPL__)
+#define kma_stats kma_backend_stats
+#endif
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+
+/***********************************************************************
+ *  Title: Allocator statistics
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the statistics of the allocator
+ *    Input: none
+ *    Output: the allocator's statistics, updated in place; in the
+ *            thread-safe build a copy, in which blocks cached by the
+ *            magazines count as free bytes but as live blocks of their
+ *            class
+ ***********************************************************************/
+kma_stats_t* kma_stats(void);
+
+#ifdef KMA_MT
+kma_stats_t* kma_backend_stats(void);
+#endif
+
+/***********************************************************************
+ *  Title: Block handed out
+ * ---------------------------------------------------------------------
+ *    Purpose: Count a live block of a class, and its header and
+ *             rounding
+ *    Input: the statistics, the class, the request size, the block
+ *           size, the size of the block's header
+ *    Output: none
+ ***********************************************************************/
+static inline void
+stats_alloc(kma_stats_t* stats, int size_class, kma_size_t size,
+	    kma_size_t block, kma_size_t header)
+{
+  stats->classes[size_class].live++;
+  stats->header_bytes += header;
+  stats->rounding_bytes += block - header - size;
+}
+
+/***********************************************************************
+ *  Title: Block given back
+ * ---------------------------------------------------------------------
+ *    Purpose: Undo stats_alloc for a freed block
+ *    Input: the same as for stats_alloc
+ *    Output: none
+ ***********************************************************************/
+static inline void
+stats_free(kma_stats_t* stats, int size_class, kma_size_t size,
+	   kma_size_t block, kma_size_t header)
+{
+  stats->classes[size_class].live--;
+  stats->header_bytes -= header;
+  stats->rounding_bytes -= block - header - size;
+}
+
+/***********************************************************************
+ *  Title: Free blocks held
+ * ---------------------------------------------------------------------
+ *    Purpose: Count free blocks of a class coming (n > 0) or going
+ *             (n < 0)
+ *    Input: the statistics, the class, the number of blocks, the
+ *           block size
+ *    Output: none
+ ***********************************************************************/
+static inline void
+stats_blocks(kma_stats_t* stats, int size_class, int n, kma_size_t block)
+{
+  stats->classes[size_class].free += n;
+  stats->free_bytes += (long) n * block;
+}
+
+/************External Declaration*****************************************/
+
+/**************Definition***************************************************/
+
+#endif /* __KMA_STATS_H__ */
@@ -0,0 +1,436 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Kernel memory allocator based on two-level segregated fit
+ *             (TLSF), with constant time kma_malloc and kma_free
+ *    File: kma_tlsf.c
+ ***************************************************************************/
+#ifdef KMA_TLSF
+#define __KMA_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+/************Private include**********************************************/
+#include "kpage.h"
+#include "kma.h"
+#include "kma_size.h"
+#include "kma_stats.h"
+#include "kma_cache.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/*
+ * Masmano et al.'s TLSF. Free blocks are kept in FLCOUNT x SLCOUNT lists:
+ * the first level is the power of two of the size, the second level splits
+ * it into SLCOUNT equal ranges (sizes below SMALLBLOCK share the first
+ * list, in ALIGNSIZE steps). A bitmap of the non-empty first levels and
+ * one of the non-empty lists of every first level find the smallest list
+ * whose blocks are all large enough with two find-first-set instructions.
+ * No call loops over blocks or lists.
+ *
+ * Every page is one area: a block that starts at the page and a sentinel
+ * used block of size 0 at its end. A used block has one word of header,
+ * its size with a bit for whether it is free and one for whether the block
+ * before it is. A free block also has the free list links and, in the
+ * last word of its space, a pointer back to its start (the boundary tag,
+ * the prev_phys of the next block), so both neighbours of a freed block
+ * are found and merged right away. When that leaves a block covering the
+ * whole page, the page goes back to kpage.
+ *
+ * Requests larger than MAXBLOCK are runs of pages.
+ */
+
+#define ALIGNSHIFT 3
+
+#define ALIGNSIZE (1 << ALIGNSHIFT)
+
+#define SLSHIFT 4
+
+#define SLCOUNT (1 << SLSHIFT)
+
+#define FLSHIFT (SLSHIFT + ALIGNSHIFT)
+
+#define SMALLBLOCK (1 << FLSHIFT) // the second level is linear below
+
+#define FLCOUNT (PAGESHIFT - FLSHIFT + 1)
+
+#define BLOCKFREE 1
+
+#define PREVFREE 2
+
+typedef struct blockT
+{
+    struct blockT* prev_phys; // last word of the block before, if free
+    unsigned long size;       // bytes after this word, and the bits
+    struct blockT* next_free; // free blocks only, the used block's data
+    struct blockT* prev_free; //   starts here
+} block_t;
+
+#define OVERHEAD sizeof(unsigned long) // header of a used block
+
+#define MINBLOCK (sizeof(block_t) - sizeof(block_t*))
+
+// a whole page as one block, between its prev_phys and the sentinel
+#define PAGEBLOCK (PAGESIZE - 3 * OVERHEAD)
+
+// largest size whose search is rounded up to no more than a page block
+#define MAXBLOCK (PAGESIZE - (PAGESIZE >> (SLSHIFT + 1)))
+
+#define SIZE(block) ((block)->size & ~(unsigned long) (BLOCKFREE | PREVFREE))
+
+#define PTR(block) ((void*) &(block)->next_free)
+
+#define BLOCK(ptr) ((block_t*) ((void*) (ptr) - offsetof(block_t, next_free)))
+
+/************Global Variables*********************************************/
+static unsigned int fl_bitmap = 0;
+static unsigned int sl_bitmap[FLCOUNT];
+static block_t* heads[FLCOUNT][SLCOUNT];
+
+// the first levels, then runs of pages; pages count in the first level
+static kma_stats_t stats = { FLCOUNT + 1 };
+static page_cache_t page_cache = { PAGECACHE_LOW, PAGECACHE_HIGH, &stats };
+
+/************Function Prototypes******************************************/
+unsigned long adjust_size(kma_size_t);
+void mapping(unsigned long, int*, int*);
+int stat_class(block_t*);
+block_t* find_block(unsigned long);
+void insert_block(block_t*);
+void remove_block(block_t*);
+block_t* next_block(block_t*);
+void mark_free(block_t*);
+void mark_used(block_t*);
+block_t* split_block(block_t*, unsigned long);
+void release_block(block_t*);
+int add_new_page(void);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+void*
+kma_malloc(kma_size_t size)
+{
+    unsigned long need = adjust_size(size);
+    if(need > MAXBLOCK)
+    {
+        stats.classes[FLCOUNT].pages += NUMPAGES(size);
+        stats_alloc(&stats, FLCOUNT, size, NUMPAGES(size) * PAGESIZE, 0);
+        return cache_get_pages(&page_cache, NUMPAGES(size))->ptr;
+    }
+
+    block_t* block = find_block(need);
+    if(block == NULL)
+    {
+        if(add_new_page() == -1)
+            return NULL;
+        block = find_block(need);
+    }
+    remove_block(block);
+    block_t* rest = split_block(block, need);
+    mark_used(block);
+    if(rest != NULL)
+        release_block(rest);
+    stats_alloc(&stats, stat_class(block), size, SIZE(block) + OVERHEAD,
+                OVERHEAD);
+    return PTR(block);
+}
+
+/* Room for the free list links and the boundary tag once it is freed */
+unsigned long
+adjust_size(kma_size_t size)
+{
+    unsigned long need = (size <= 0) ? 0 : (size + ALIGNSIZE - 1) & ~(ALIGNSIZE - 1);
+    return (need < MINBLOCK) ? MINBLOCK : need;
+}
+
+/* The list of a size: the first level is its power of two, the second
+ * level the next SLSHIFT bits
+ */
+void
+mapping(unsigned long size, int* fl, int* sl)
+{
+    if(size < SMALLBLOCK)
+    {
+        *fl = 0;
+        *sl = size / (SMALLBLOCK / SLCOUNT);
+        return;
+    }
+    int msb = 31 - __builtin_clz((unsigned int) size);
+    *sl = (size >> (msb - SLSHIFT)) ^ SLCOUNT;
+    *fl = msb - FLSHIFT + 1;
+}
+
+int
+stat_class(block_t* block)
+{
+    int fl, sl;
+    mapping(SIZE(block), &fl, &sl);
+    return fl;
+}
+
+/*
+ * Round the size up to the start of the next list, so that any block of
+ * the list found fits, and find the first non-empty list from there: in
+ * the same first level, or else in the next non-empty one.
+ */
+block_t*
+find_block(unsigned long size)
+{
+    int fl, sl;
+    if(size >= SMALLBLOCK)
+        size += (1UL << (31 - __builtin_clz((unsigned int) size) - SLSHIFT)) - 1;
+    mapping(size, &fl, &sl);
+
+    unsigned int sl_map = sl_bitmap[fl] & (~0U << sl);
+    if(sl_map == 0)
+    {
+        unsigned int fl_map = fl_bitmap & (~0U << (fl + 1));
+        if(fl_map == 0)
+            return NULL;
+        fl = __builtin_ctz(fl_map);
+        sl_map = sl_bitmap[fl];
+    }
+    sl = __builtin_ctz(sl_map);
+    return heads[fl][sl];
+}
+
+void
+insert_block(block_t* block)
+{
+    int fl, sl;
+    mapping(SIZE(block), &fl, &sl);
+    block->prev_free = NULL;
+    block->next_free = heads[fl][sl];
+    if(block->next_free)
+        block->next_free->prev_free = block;
+    heads[fl][sl] = block;
+    fl_bitmap |= 1U << fl;
+    sl_bitmap[fl] |= 1U << sl;
+    stats_blocks(&stats, fl, 1, SIZE(block) + OVERHEAD);
+}
+
+void
+remove_block(block_t* block)
+{
+    int fl, sl;
+    mapping(SIZE(block), &fl, &sl);
+    if(block->prev_free)
+        block->prev_free->next_free = block->next_free;
+    else
+        heads[fl][sl] = block->next_free;
+    if(block->next_free)
+        block->next_free->prev_free = block->prev_free;
+    if(heads[fl][sl] == NULL)
+    {
+        sl_bitmap[fl] &= ~(1U << sl);
+        if(sl_bitmap[fl] == 0)
+            fl_bitmap &= ~(1U << fl);
+    }
+    stats_blocks(&stats, fl, -1, SIZE(block) + OVERHEAD);
+}
+
+block_t*
+next_block(block_t* block)
+{
+    return (block_t*)((void*)block + OVERHEAD + SIZE(block));
+}
+
+/* Set the bits and the boundary tag the block's neighbours look at */
+void
+mark_free(block_t* block)
+{
+    block_t* next = next_block(block);
+    block->size |= BLOCKFREE;
+    next->prev_phys = block;
+    next->size |= PREVFREE;
+}
+
+void
+mark_used(block_t* block)
+{
+    block->size &= ~(unsigned long) BLOCKFREE;
+    next_block(block)->size &= ~(unsigned long) PREVFREE;
+}
+
+/* Cut what is beyond size off a block that is on no list, if it makes a
+ * block of its own; the rest is for the caller to release
+ */
+block_t*
+split_block(block_t* block, unsigned long size)
+{
+    if(SIZE(block) < size + sizeof(block_t))
+        return NULL;
+    stats.classes[stat_class(block)].splits++;
+    block_t* rest = (block_t*)(PTR(block) + size - OVERHEAD);
+    rest->size = SIZE(block) - size - OVERHEAD;
+    block->size = size | (block->size & (BLOCKFREE | PREVFREE));
+    return rest;
+}
+
+/*
+ * Merge a block that is no longer used with whichever neighbours are free,
+ * and put the result on its list, or give the page back if it is all free.
+ */
+void
+release_block(block_t* block)
+{
+    if(block->size & PREVFREE)
+    {
+        block_t* prev = block->prev_phys;
+        remove_block(prev);
+        stats.classes[stat_class(prev)].coalesces++;
+        prev->size += SIZE(block) + OVERHEAD;
+        block = prev;
+    }
+    block_t* next = next_block(block);
+    if(next->size & BLOCKFREE)
+    {
+        remove_block(next);
+        stats.classes[stat_class(next)].coalesces++;
+        block->size += SIZE(next) + OVERHEAD;
+    }
+    if(SIZE(block) == PAGEBLOCK)
+    {
+        stats.classes[0].pages--;
+        stats.header_bytes -= PAGESIZE - PAGEBLOCK - OVERHEAD;
+        cache_free_page(&page_cache, page_descriptor(block));
+        return;
+    }
+    mark_free(block);
+    insert_block(block);
+}
+
+/* A page is one free block, whose prev_phys word is never used, and the
+ * sentinel that stops merging at the end of the page
+ */
+int
+add_new_page(void)
+{
+    kpage_t* page = cache_get_page(&page_cache);
+    if(page == NULL)
+        return -1;
+    int fl;
+    for(fl = 0; fl < FLCOUNT; fl++)
+        stats.classes[fl].size = SMALLBLOCK << fl;
+    stats.classes[0].pages++;
+    stats.header_bytes += PAGESIZE - PAGEBLOCK - OVERHEAD;
+
+    block_t* block = page->ptr;
+    block->size = PAGEBLOCK;
+    next_block(block)->size = 0;
+    mark_free(block);
+    insert_block(block);
+    return 0;
+}
+
+void
+kma_free(void* ptr, kma_size_t size)
+{
+    if(adjust_size(size) > MAXBLOCK)
+    {
+        stats.classes[FLCOUNT].pages -= NUMPAGES(size);
+        stats_free(&stats, FLCOUNT, size, NUMPAGES(size) * PAGESIZE, 0);
+        cache_free_pages(&page_cache, page_descriptor(ptr));
+        return;
+    }
+    block_t* block = BLOCK(ptr);
+    stats_free(&stats, stat_class(block), size, SIZE(block) + OVERHEAD,
+               OVERHEAD);
+    release_block(block);
+}
+
+/*
+ * A block grows into the free block after it and shrinks by releasing its
+ * tail. Runs stay where they are if they need as many pages.
+ */
+int
+kma_resize(void* ptr, kma_size_t old_size, kma_size_t new_size)
+{
+    unsigned long need = adjust_size(new_size);
+    if(adjust_size(old_size) > MAXBLOCK || need > MAXBLOCK)
+    {
+        if(adjust_size(old_size) <= MAXBLOCK || need <= MAXBLOCK
+           || NUMPAGES(old_size) != NUMPAGES(new_size))
+            return FALSE;
+        kma_size_t run = NUMPAGES(old_size) * PAGESIZE;
+        stats_free(&stats, FLCOUNT, old_size, run, 0);
+        stats_alloc(&stats, FLCOUNT, new_size, run, 0);
+        return TRUE;
+    }
+
+    block_t* block = BLOCK(ptr);
+    block_t* next = next_block(block);
+    if(need > SIZE(block)
+       && (!(next->size & BLOCKFREE)
+           || SIZE(block) + OVERHEAD + SIZE(next) < need))
+        return FALSE;
+
+    stats_free(&stats, stat_class(block), old_size, SIZE(block) + OVERHEAD,
+               OVERHEAD);
+    if(need > SIZE(block))
+    {
+        remove_block(next);
+        stats.classes[stat_class(next)].coalesces++;
+        block->size += SIZE(next) + OVERHEAD;
+        mark_used(block);
+    }
+    block_t* rest = split_block(block, need);
+    if(rest != NULL)
+        release_block(rest);
+    stats_alloc(&stats, stat_class(block), new_size, SIZE(block) + OVERHEAD,
+                OVERHEAD);
+    return TRUE;
+}
+
+/* Only runs come straight from kpage, blocks have held free list links */
+int
+kma_zeroed(void* ptr, kma_size_t size)
+{
+    return adjust_size(size) > MAXBLOCK && page_descriptor(ptr)->zero;
+}
+
+/* Every block is its own search, so a batch is a loop */
+int
+kma_malloc_batch(kma_size_t size, int n, void** out)
+{
+    int i;
+    for(i = 0; i < n; i++)
+    {
+        out[i] = kma_malloc(size);
+        if(out[i] == NULL)
+            break;
+    }
+    return i;
+}
+
+void
+kma_free_batch(void** ptrs, kma_size_t size, int n)
+{
+    int i;
+    for(i = 0; i < n; i++)
+        kma_free(ptrs[i], size);
+}
+
+/* The page cache empties by itself once every page is freed */
+void
+kma_drain(void)
+{
+}
+
+kma_stats_t*
+kma_stats(void)
+{
+    return &stats;
+}
+
+#endif // KMA_TLSF
@@ -0,0 +1,350 @@
+/***************************************************************************
+ *  Title: Traces
+ * -------------------------------------------------------------------------
+ *    Purpose: Loading text and binary traces for the test harness
+ *    File: kma_trace.c
+ ***************************************************************************/
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/************Private include**********************************************/
+#include "kma.h"
+#include "kma_trace.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// stdio buffer of a trace being written
+#define WRITEBUFSIZE (1 << 20)
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+int map_trace(trace_t*, char*);
+void parse_trace(trace_t*, char*);
+void check_trace(trace_t*);
+void write_header(trace_writer_t*);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+trace_t*
+load_trace(char* file)
+{
+  trace_t* trace = malloc(sizeof(trace_t));
+  assert(trace != NULL);
+  memset(trace, 0, sizeof(trace_t));
+
+  if (!map_trace(trace, file))
+    {
+      parse_trace(trace, file);
+    }
+  check_trace(trace);
+
+  return trace;
+}
+
+/* Map the file if it is a binary trace, return 0 if it is not */
+int
+map_trace(trace_t* trace, char* file)
+{
+  struct stat st;
+  trace_header_t* header;
+
+  int fd = open(file, O_RDONLY);
+  if (fd == -1)
+    {
+      error("unable to open input test file", file);
+    }
+  if (fstat(fd, &st) != 0)
+    {
+      error("unable to stat input test file", file);
+    }
+  if (st.st_size < sizeof(trace_header_t))
+    {
+      close(fd);
+      return 0;
+    }
+
+  trace->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (trace->map == MAP_FAILED)
+    {
+      error("unable to map input test file", file);
+    }
+  trace->map_size = st.st_size;
+
+  header = trace->map;
+  if (header->magic != TRACEMAGIC)
+    {
+      munmap(trace->map, trace->map_size);
+      trace->map = NULL;
+      return 0;
+    }
+  if (header->version != TRACEVERSION)
+    {
+      error("unsupported binary trace version in", file);
+    }
+  if (trace->map_size != sizeof(trace_header_t)
+      + (size_t) header->n_records * sizeof(trace_record_t))
+    {
+      error("truncated binary trace", file);
+    }
+
+  trace->n_req = header->n_req;
+  trace->n_records = header->n_records;
+  trace->records = (trace_record_t*) (header + 1);
+  madvise(trace->map, trace->map_size, MADV_SEQUENTIAL);
+
+  return 1;
+}
+
+/* Parse the REQUEST, FREE, REALLOC, BATCH and BATCHFREE lines of a text
+ * trace into records
+ */
+void
+parse_trace(trace_t* trace, char* file)
+{
+  char command[16];
+  int capacity = 1024;
+  trace_record_t* rec;
+
+  FILE* f_test = fopen(file, "r");
+  if (f_test == NULL)
+    {
+      error("unable to open input test file", file);
+    }
+
+  // Get the number of requests in the trace file
+  if (fscanf(f_test, "%d\n", &trace->n_req) != 1)
+    {
+      error("Couldn't read number of requests at head of file", "");
+    }
+
+  trace->records = malloc(capacity * sizeof(trace_record_t));
+  assert(trace->records != NULL);
+
+  while (fscanf(f_test, "%10s", command) == 1)
+    {
+      if (trace->n_records == capacity)
+	{
+	  capacity *= 2;
+	  trace->records = realloc(trace->records,
+				   capacity * sizeof(trace_record_t));
+	  assert(trace->records != NULL);
+	}
+      rec = &trace->records[trace->n_records++];
+      rec->count = 1;
+
+      if (strcmp(command, "REQUEST") == 0)
+	{
+	  rec->op = TRACE_REQUEST;
+	  if (fscanf(f_test, "%d %d", &rec->id, &rec->size) != 2)
+	    error("Not enough arguments to REQUEST", "");
+	}
+      else if (strcmp(command, "FREE") == 0)
+	{
+	  rec->op = TRACE_FREE;
+	  rec->size = 0;
+	  if (fscanf(f_test, "%d", &rec->id) != 1)
+	    error("Not enough arguments to FREE", "");
+	}
+      else if (strcmp(command, "REALLOC") == 0)
+	{
+	  rec->op = TRACE_REALLOC;
+	  if (fscanf(f_test, "%d %d", &rec->id, &rec->size) != 2)
+	    error("Not enough arguments to REALLOC", "");
+	}
+      else if (strcmp(command, "BATCH") == 0)
+	{
+	  rec->op = TRACE_BATCH;
+	  if (fscanf(f_test, "%d %d %d", &rec->id, &rec->count, &rec->size)
+	      != 3)
+	    error("Not enough arguments to BATCH", "");
+	}
+      else if (strcmp(command, "BATCHFREE") == 0)
+	{
+	  rec->op = TRACE_BATCHFREE;
+	  rec->size = 0;
+	  if (fscanf(f_test, "%d %d", &rec->id, &rec->count) != 2)
+	    error("Not enough arguments to BATCHFREE", "");
+	}
+      else
+	{
+	  error("unknown command type:", command);
+	}
+    }
+
+  fclose(f_test);
+}
+
+void
+check_trace(trace_t* trace)
+{
+  int i;
+
+  for (i = 0; i < trace->n_records; i++)
+    {
+      trace_record_t* rec = &trace->records[i];
+
+      if (rec->op < TRACE_REQUEST || rec->op > TRACE_BATCHFREE)
+	{
+	  error("unknown record type in trace", "");
+	}
+      if (rec->count < 1 || rec->count > MAXBATCH
+	  || (rec->count > 1 && rec->op < TRACE_BATCH))
+	{
+	  error("bad batch count in trace", "");
+	}
+      if ((rec->op == TRACE_REQUEST || rec->op == TRACE_REALLOC
+	   || rec->op == TRACE_BATCH) && rec->size < 1)
+	{
+	  error("bad request size in trace", "");
+	}
+      if (rec->id < 0 || rec->id > trace->n_req - rec->count)
+	{
+	  error("request id out of range in trace", "");
+	}
+    }
+}
+
+void
+write_trace(trace_t* trace, char* file)
+{
+  trace_writer_t* writer = open_trace(file, 1, trace->n_req);
+  int i;
+
+  for (i = 0; i < trace->n_records; i++)
+    {
+      write_record(writer, &trace->records[i]);
+    }
+  close_trace(writer);
+}
+
+trace_writer_t*
+open_trace(char* file, int binary, int n_req)
+{
+  trace_writer_t* writer = malloc(sizeof(trace_writer_t));
+  assert(writer != NULL);
+  writer->name = file;
+  writer->binary = binary;
+  writer->n_req = n_req;
+  writer->n_records = 0;
+
+  writer->file = fopen(file, binary ? "wb" : "w");
+  if (writer->file == NULL)
+    {
+      error("unable to open output trace file", file);
+    }
+  setvbuf(writer->file, NULL, _IOFBF, WRITEBUFSIZE);
+
+  if (binary)
+    {
+      write_header(writer);
+    }
+  else if (fprintf(writer->file, "%d\n", n_req) < 0)
+    {
+      error("unable to write output trace file", file);
+    }
+
+  return writer;
+}
+
+/* The header of a binary trace, at the current position */
+void
+write_header(trace_writer_t* writer)
+{
+  trace_header_t header;
+
+  header.magic = TRACEMAGIC;
+  header.version = TRACEVERSION;
+  header.n_req = writer->n_req;
+  header.n_records = writer->n_records;
+  if (fwrite(&header, sizeof(header), 1, writer->file) != 1)
+    {
+      error("unable to write output trace file", writer->name);
+    }
+}
+
+void
+write_record(trace_writer_t* writer, trace_record_t* rec)
+{
+  int ok;
+
+  writer->n_records++;
+  if (writer->binary)
+    {
+      ok = fwrite(rec, sizeof(trace_record_t), 1, writer->file) == 1;
+    }
+  else if (rec->op == TRACE_REQUEST)
+    {
+      ok = fprintf(writer->file, "REQUEST %d %d\n", rec->id, rec->size) > 0;
+    }
+  else if (rec->op == TRACE_REALLOC)
+    {
+      ok = fprintf(writer->file, "REALLOC %d %d\n", rec->id, rec->size) > 0;
+    }
+  else if (rec->op == TRACE_BATCH)
+    {
+      ok = fprintf(writer->file, "BATCH %d %d %d\n", rec->id, rec->count,
+		   rec->size) > 0;
+    }
+  else if (rec->op == TRACE_BATCHFREE)
+    {
+      ok = fprintf(writer->file, "BATCHFREE %d %d\n", rec->id, rec->count)
+	> 0;
+    }
+  else
+    {
+      ok = fprintf(writer->file, "FREE %d\n", rec->id) > 0;
+    }
+  if (!ok)
+    {
+      error("unable to write output trace file", writer->name);
+    }
+}
+
+void
+close_trace(trace_writer_t* writer)
+{
+  if (writer->binary)
+    {
+      if (fseek(writer->file, 0, SEEK_SET) != 0)
+	{
+	  error("unable to write output trace file", writer->name);
+	}
+      write_header(writer);
+    }
+  if (fclose(writer->file) != 0)
+    {
+      error("unable to write output trace file", writer->name);
+    }
+  free(writer);
+}
+
+void
+unload_trace(trace_t* trace)
+{
+  if (trace->map != NULL)
+    {
+      munmap(trace->map, trace->map_size);
+    }
+  else
+    {
+      free(trace->records);
+    }
+  free(trace);
+}
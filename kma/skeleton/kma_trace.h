@@ -0,0 +1,146 @@
+/***************************************************************************
+ *  Title: Traces
+ * -------------------------------------------------------------------------
+ *    Purpose: Loading text and binary traces for the test harness
+ *    File: kma_trace.h
+ ***************************************************************************/
+
+#ifndef __KMA_TRACE_H__
+#define __KMA_TRACE_H__
+
+/************System include***********************************************/
+#include <stddef.h>
+#include <stdio.h>
+
+/************Private include**********************************************/
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/*  A binary trace is a trace_header_t followed by n_records fixed size
+ *  records, in the byte order of the machine that wrote it. It holds
+ *  exactly what the text trace does, so it can be replayed straight
+ *  from an mmap of the file.
+ */
+#define TRACEMAGIC 0x54414d4b // "KMAT"
+
+#define TRACEVERSION 2
+
+#define MAXBATCH 256 // requests of a BATCH or BATCHFREE record
+
+enum TRACE_OP
+  {
+    TRACE_REQUEST,
+    TRACE_FREE,
+    TRACE_REALLOC,
+    TRACE_BATCH,    // requests id, ..., id + count - 1, all of one size
+    TRACE_BATCHFREE // the requests of a BATCH, freed together
+  };
+
+typedef struct
+{
+  unsigned int magic;
+  int version;
+  int n_req;     // the number at the head of the text trace
+  int n_records;
+} trace_header_t;
+
+typedef struct
+{
+  int op;
+  int id;
+  int size;      // REQUEST and BATCH, and the new size for REALLOC
+  int count;     // requests of a BATCH or BATCHFREE, 1 otherwise
+} trace_record_t;
+
+typedef struct
+{
+  int n_req;
+  int n_records;
+  trace_record_t* records;
+  void* map;     // the mapped file of a binary trace
+  size_t map_size;
+} trace_t;
+
+typedef struct
+{
+  FILE* file;
+  char* name;
+  int binary;
+  int n_req;
+  int n_records; // written so far
+} trace_writer_t;
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+
+/***********************************************************************
+ *  Title: Loads a trace
+ * ---------------------------------------------------------------------
+ *    Purpose: Maps a binary trace, or parses a text trace into
+ *             records, and checks that every id is in range, so
+ *             that replaying it needs no parsing or checking
+ *    Input: the trace file name
+ *    Output: the trace; errors are fatal
+ ***********************************************************************/
+trace_t* load_trace(char* file);
+
+/***********************************************************************
+ *  Title: Writes a binary trace
+ * ---------------------------------------------------------------------
+ *    Purpose: Writes a loaded trace in the binary format
+ *    Input: the trace, the output file name
+ *    Output: none; errors are fatal
+ ***********************************************************************/
+void write_trace(trace_t* trace, char* file);
+
+/***********************************************************************
+ *  Title: Opens a trace for writing
+ * ---------------------------------------------------------------------
+ *    Purpose: Starts a text or binary trace that is written one
+ *             record at a time, so that it never has to be held in
+ *             memory
+ *    Input: the output file name, whether to write the binary format,
+ *           the number at the head of the trace
+ *    Output: the writer; errors are fatal
+ ***********************************************************************/
+trace_writer_t* open_trace(char* file, int binary, int n_req);
+
+/***********************************************************************
+ *  Title: Writes a record
+ * ---------------------------------------------------------------------
+ *    Purpose: Appends a record to a trace from open_trace
+ *    Input: the writer, the record
+ *    Output: none; errors are fatal
+ ***********************************************************************/
+void write_record(trace_writer_t* writer, trace_record_t* rec);
+
+/***********************************************************************
+ *  Title: Closes a trace
+ * ---------------------------------------------------------------------
+ *    Purpose: Flushes and closes a trace from open_trace, filling in
+ *             the number of records of a binary trace
+ *    Input: the writer
+ *    Output: none; errors are fatal
+ ***********************************************************************/
+void close_trace(trace_writer_t* writer);
+
+/***********************************************************************
+ *  Title: Unloads a trace
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases a trace from load_trace
+ *    Input: the trace
+ *    Output: none
+ ***********************************************************************/
+void unload_trace(trace_t* trace);
+
+/************External Declaration*****************************************/
+
+/**************Definition***************************************************/
+
+#endif /* __KMA_TRACE_H__ */
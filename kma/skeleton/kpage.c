@@ -49,6 +49,10 @@
 #include <string.h>
 #include <strings.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#ifdef KMA_MT
+#include <pthread.h>
+#endif
 
 /************Private include**********************************************/
 #include "kpage.h"
@@ -61,15 +65,87 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+/*  In the thread-safe build every entry point holds page_lock, which
+ *  covers the statistics, the page ids and the pool itself.
+ */
+#ifdef KMA_MT
+#define LOCK_PAGES() pthread_mutex_lock(&page_lock)
+#define UNLOCK_PAGES() pthread_mutex_unlock(&page_lock)
+#else
+#define LOCK_PAGES()
+#define UNLOCK_PAGES()
+#endif
+
+/*  With KPAGE_HUGE the pool is backed by 2MB pages: hugetlb pages if the
+ *  system has enough of them reserved for the whole pool, otherwise
+ *  transparent huge pages on a 2MB aligned pool. Freed memory is then only
+ *  given back a whole huge page at a time, since releasing part of one
+ *  would split it.
+ */
+#define HUGEPAGESIZE (2 * 1024 * 1024)
+
+#ifdef KPAGE_HUGE
+#define RELEASEALIGN HUGEPAGESIZE
+#else
+#define RELEASEALIGN PAGESIZE
+#endif
+
 /************Global Variables*********************************************/
-static kpage_stat_t kpage_stats = { 0, 0, 0, PAGESIZE };
+static kpage_stat_t kpage_stats = { 0, 0, 0, PAGESIZE, 0 };
 
+/*  The pool is one range of POOLPAGES pages of address space, reserved
+ *  without any memory behind it. It is committed an arena (MAXPAGES pages)
+ *  at a time as the pages below top, which have been handed out at least
+ *  once, grow into it. Freed pages are given back to the OS right away, so
+ *  both startup cost and resident memory follow the pages in use.
+ */
 static void* pool = NULL;
-static void* next_free_page = NULL;
+static int top = 0;
+static int num_arenas = 0;
+static char* backing = "small pages";
+
+// one descriptor per page of the pool, indexed by page_index; only the
+// first page of a run uses its own, and every page of the run knows it
+static kpage_t descriptors[POOLPAGES];
+static int run_head[POOLPAGES];
+
+/*  Free pages below top form runs of consecutive pages. The first and the
+ *  last page of a free run are tagged with its length in run_pages (0 for
+ *  pages in use), so a freed run finds the free runs it touches in
+ *  constant time. The free runs are kept on segregated lists through
+ *  run_next and run_prev: one list for each length up to EXACTRUNS pages,
+ *  then one for each power of two. A bit of run_lists is set for every
+ *  list that isn't empty, and only then is its head in free_runs valid.
+ */
+#define EXACTSHIFT 4
+
+#define EXACTRUNS (1 << EXACTSHIFT)
+
+#define NUMRUNLISTS 32 // runs of up to 1 << 19 pages
+
+static int run_pages[POOLPAGES];
+static int run_next[POOLPAGES];
+static int run_prev[POOLPAGES];
+static int free_runs[NUMRUNLISTS];
+static unsigned int run_lists = 0;
+
+// pages that may hold data: set when handed out, cleared when the memory
+// goes back to the OS and reads as zero again
+static char page_dirty[POOLPAGES];
+
+#ifdef KMA_MT
+static pthread_mutex_t page_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 /************Function Prototypes******************************************/
-void* allocPage();
-void freePage(void*);
+int allocRun(int);
+void freeRun(int, int);
+void setRun(int, int);
+int runList(int);
+void linkRun(int);
+void unlinkRun(int);
+void releasePages(int, int);
+void commitArena();
 void initPages();
 
 /************External Declaration*****************************************/
@@ -78,19 +154,40 @@ void initPages();
 
 kpage_t*
 get_page()
+{
+  return get_pages(1);
+}
+
+kpage_t*
+get_pages(int n)
 {
   static int id = 0;
   kpage_t* res;
+  int index, i;
   
-  kpage_stats.num_requested++;
-  kpage_stats.num_in_use++;
+  assert(n > 0);
   
-  res = (kpage_t*) malloc(sizeof(kpage_t));
-  res->id = id++;
-  res->size = kpage_stats.page_size;
-  res->ptr = allocPage();
+  LOCK_PAGES();
+  kpage_stats.num_requested += n;
+  kpage_stats.num_in_use += n;
+  if (kpage_stats.num_in_use > kpage_stats.num_peak)
+    {
+      kpage_stats.num_peak = kpage_stats.num_in_use;
+    }
+  
+  index = allocRun(n);
   
-  assert(res->ptr != NULL);
+  res = &descriptors[index];
+  res->id = id++;
+  res->size = n * kpage_stats.page_size;
+  res->ptr = pool + index * PAGESIZE;
+  res->zero = memchr(&page_dirty[index], 1, n) == NULL;
+  memset(&page_dirty[index], 1, n);
+  for (i = 0; i < n; i++)
+    {
+      run_head[index + i] = index;
+    }
+  UNLOCK_PAGES();
   
   return res;	
 }
@@ -98,15 +195,28 @@ get_page()
 void
 free_page(kpage_t* ptr)
 {
+  free_pages(ptr);
+}
+
+void
+free_pages(kpage_t* ptr)
+{
+  int n;
+  
   assert(ptr != NULL);
   assert(ptr->ptr != NULL);
-  assert(kpage_stats.num_in_use > 0);
   
-  kpage_stats.num_freed++;
-  kpage_stats.num_in_use--;
+  n = ptr->size / PAGESIZE;
+  
+  LOCK_PAGES();
+  assert(kpage_stats.num_in_use >= n);
   
-  freePage(ptr->ptr);
-  free(ptr);
+  kpage_stats.num_freed += n;
+  kpage_stats.num_in_use -= n;
+  
+  freeRun(page_index(ptr->ptr), n);
+  ptr->ptr = NULL;
+  UNLOCK_PAGES();
 }
 
 kpage_stat_t*
@@ -114,71 +224,298 @@ page_stats()
 {
   static kpage_stat_t stats;
   
-  return memcpy(&stats, &kpage_stats, sizeof(kpage_stat_t));
+  LOCK_PAGES();
+  memcpy(&stats, &kpage_stats, sizeof(kpage_stat_t));
+  UNLOCK_PAGES();
+  
+  return &stats;
+}
+
+int
+page_index(void* ptr)
+{
+  assert(pool != NULL);
+  assert(ptr >= pool && ptr < pool + POOLPAGES * PAGESIZE);
+  
+  return (BASEADDR(ptr) - pool) / PAGESIZE;
+}
+
+kpage_t*
+page_descriptor(void* ptr)
+{
+  int index = run_head[page_index(ptr)];
+  kpage_t* res = &descriptors[index];
+  
+  assert(res->ptr == pool + index * PAGESIZE);
+  assert(BASEADDR(ptr) < res->ptr + res->size);
+  
+  return res;
 }
 
-void*
-allocPage()
+/* A run from the first list that can hold n pages: every run on an exact
+ * list can, on a power of two list the first that does is taken, failing
+ * that the first run of the next list that isn't empty. Fresh pages come
+ * from the top of the pool if there is no run large enough. The pages are
+ * taken from the end of a run so that what is left of it stays where it
+ * is, and on its list unless its length drops below the list's.
+ */
+int
+allocRun(int n)
 {
-  void* res;
+  int list = runList(n);
+  unsigned int lists;
+  int run = -1;
+  int len, index;
   
   if (pool == NULL)
     {
       initPages();
     }
   
-  res = next_free_page;
+  if (n > EXACTRUNS)
+    {
+      if (run_lists & (1u << list))
+	{
+	  for (run = free_runs[list]; run != -1; run = run_next[run])
+	    {
+	      if (run_pages[run] >= n)
+		{
+		  break;
+		}
+	    }
+	}
+      list++;
+    }
   
-  if (res == NULL)
+  lists = run_lists & (~0u << list);
+  if (run == -1 && lists != 0)
     {
-      error("error: all pages already allocated", "");
+      run = free_runs[__builtin_ctz(lists)];
     }
   
-  next_free_page = *((void**)next_free_page);
+  if (run == -1)
+    {
+      if (top + n > POOLPAGES)
+	{
+	  error("error: all pages already allocated", "");
+	}
+      index = top;
+      top += n;
+      while (top > num_arenas * MAXPAGES)
+	{
+	  commitArena();
+	}
+    }
+  else
+    {
+      len = run_pages[run];
+      if (len == n)
+	{
+	  unlinkRun(run);
+	}
+      else if (runList(len - n) == runList(len))
+	{
+	  setRun(run, len - n);
+	}
+      else
+	{
+	  unlinkRun(run);
+	  setRun(run, len - n);
+	  linkRun(run);
+	}
+      index = run + len - n;
+    }
   
-  assert(res != NULL);
+  memset(&run_pages[index], 0, n * sizeof(int));
   
-  return res;
+  return index;
 }
 
+/* Give the pages back to the OS and merge the run with the free runs right
+ * after and before it. A run that ends up at the top of the pool lowers top
+ * instead.
+ */
 void
-freePage(void* ptr)
+freeRun(int index, int n)
 {
-  assert(ptr != NULL);
+#ifndef KPAGE_HUGE
+  releasePages(index, n);
+#endif
   
-  *((void**)ptr) = next_free_page;
-  next_free_page = ptr;
+  if (index + n < top && run_pages[index + n] > 0)
+    {
+      unlinkRun(index + n);
+      n += run_pages[index + n];
+    }
   
-  if (kpage_stats.num_in_use == 0)
+  if (index > 0 && run_pages[index - 1] > 0)
     {
-      free(pool);
-      pool = NULL;
-      next_free_page = NULL;
+      int len = run_pages[index - 1];
+      
+      index -= len;
+      n += len;
+      unlinkRun(index);
     }
+  
+#ifdef KPAGE_HUGE
+  releasePages(index, n);
+#endif
+  
+  if (index + n == top)
+    {
+      top = index;
+      return;
+    }
+  
+  setRun(index, n);
+  linkRun(index);
+}
+
+void
+setRun(int index, int n)
+{
+  run_pages[index] = n;
+  run_pages[index + n - 1] = n;
+}
+
+/* The list of runs of n pages */
+int
+runList(int n)
+{
+  if (n <= EXACTRUNS)
+    {
+      return n - 1;
+    }
+  return EXACTRUNS + (31 - __builtin_clz((unsigned int) n)) - EXACTSHIFT;
+}
+
+/* Push a run set up with setRun on its list */
+void
+linkRun(int index)
+{
+  int list = runList(run_pages[index]);
+  
+  run_prev[index] = -1;
+  run_next[index] = -1;
+  if (run_lists & (1u << list))
+    {
+      run_next[index] = free_runs[list];
+      run_prev[free_runs[list]] = index;
+    }
+  free_runs[list] = index;
+  run_lists |= 1u << list;
+}
+
+/* Take a run off its list, before its length changes */
+void
+unlinkRun(int index)
+{
+  int list = runList(run_pages[index]);
+  
+  if (run_prev[index] != -1)
+    {
+      run_next[run_prev[index]] = run_next[index];
+    }
+  else
+    {
+      free_runs[list] = run_next[index];
+      if (free_runs[list] == -1)
+	{
+	  run_lists &= ~(1u << list);
+	}
+    }
+  if (run_next[index] != -1)
+    {
+      run_prev[run_next[index]] = run_prev[index];
+    }
+}
+
+/* Give the memory of free pages back to the OS, in whole RELEASEALIGN units */
+void
+releasePages(int index, int n)
+{
+  unsigned long start = (unsigned long) (pool + index * PAGESIZE);
+  unsigned long end = start + n * PAGESIZE;
+  
+  start = (start + RELEASEALIGN - 1) & ~(RELEASEALIGN - 1);
+  end &= ~(RELEASEALIGN - 1);
+  
+  if (start < end)
+    {
+      if (madvise((void*) start, end - start, MADV_DONTNEED) != 0)
+	{
+	  error("error: could not release pages", "");
+	}
+      memset(&page_dirty[page_index((void*) start)], 0,
+	     (end - start) / PAGESIZE);
+    }
+}
+
+/* Make the next arena of the reserved range usable. Its memory is still
+ * only faulted in page by page as it is touched.
+ */
+void
+commitArena()
+{
+  void* arena;
+  
+  assert(num_arenas < MAXARENAS);
+  
+  arena = pool + num_arenas * MAXPAGES * PAGESIZE;
+  if (mprotect(arena, MAXPAGES * PAGESIZE, PROT_READ | PROT_WRITE) != 0)
+    {
+      error("error: could not commit arena", "");
+    }
+  num_arenas++;
 }
 
+/* Reserve the address space of the pool, aligned to PAGESIZE (or to a huge
+ * page with KPAGE_HUGE)
+ */
 void
 initPages()
 {
-  int i;
+  size_t size = (size_t) POOLPAGES * PAGESIZE;
+  unsigned long align = PAGESIZE;
+  void* res = MAP_FAILED;
   
-  assert(next_free_page == NULL);
   assert(pool == NULL);
   
-  //pool = calloc(MAXPAGES, PAGESIZE);
-  int result = posix_memalign(&pool, PAGESIZE, MAXPAGES * PAGESIZE);
-  if(result)
-    error("Error using posix_memalign to allocate memory", "");
-  next_free_page = pool;
+#ifdef KPAGE_HUGE
+  align = HUGEPAGESIZE;
+#ifdef MAP_HUGETLB
+  // hugetlb mappings come aligned to the huge page size
+  res = mmap(NULL, size, PROT_NONE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (res != MAP_FAILED)
+    {
+      backing = "hugetlb pages";
+    }
+#endif
+#endif
   
-  // use ptr to point to the next free page struct
-  for (i = 0; i < (MAXPAGES - 1); i++)
+  if (res == MAP_FAILED)
     {
-      void* ptr = (pool + i * PAGESIZE);
-      void* next = ptr + PAGESIZE;
-      
-      *((void**) ptr) = next;
+      res = mmap(NULL, size + align, PROT_NONE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (res == MAP_FAILED)
+	{
+	  error("error: could not reserve the page pool", "");
+	}
+      res = (void*) (((unsigned long) res + align - 1) & ~(align - 1));
+#ifdef KPAGE_HUGE
+      if (madvise(res, size, MADV_HUGEPAGE) == 0)
+	{
+	  backing = "transparent huge pages";
+	}
+#endif
     }
   
-  *((void**)(pool + (MAXPAGES - 1) * PAGESIZE)) = NULL;
+  pool = res;
+}
+
+char*
+page_backing()
+{
+  return backing;
 }
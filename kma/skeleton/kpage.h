@@ -68,7 +68,11 @@
 
 #define PAGESIZE 8192
 
-#define MAXPAGES 4096
+#define MAXPAGES 4096 // pages per arena
+
+#define MAXARENAS 16
+
+#define POOLPAGES (MAXARENAS * MAXPAGES)
 
 /***********************************************************************
  *  Title: Base Address Macro
@@ -78,13 +82,23 @@
  *    Input: pointer
  *    Output: the base address of the page
  ***********************************************************************/
-#define BASEADDR(x) ((void*)(((int) (x)) & ~(PAGESIZE-1)))
+#define BASEADDR(x) ((void*)(((unsigned long) (x)) & ~(PAGESIZE-1)))
+
+/***********************************************************************
+ *  Title: Number of pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the number of pages needed to hold size bytes
+ *    Input: size in bytes
+ *    Output: the number of pages for get_pages
+ ***********************************************************************/
+#define NUMPAGES(size) (((size) + PAGESIZE - 1) / PAGESIZE)
 
 typedef struct
 {
   int id;
   void* ptr;
   int size;
+  int zero; // the pages were all zero when handed out
 } kpage_t;
 
 typedef struct
@@ -93,6 +107,7 @@ typedef struct
   int num_freed;
   int num_in_use;
   int page_size;
+  int num_peak; // most pages in use at once
 } kpage_stat_t;
 
 /************Global Variables*********************************************/
@@ -117,6 +132,27 @@ EXTERN kpage_t* get_page();
  ***********************************************************************/
 EXTERN void free_page(kpage_t*);
 
+/***********************************************************************
+ *  Title: Allocates a run of memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates n consecutive memory pages. The page
+ *             statistics count every page of the run.
+ *    Input: the number of pages
+ *    Output: the memory page structure of the run; ptr points to its
+ *            first page and size is n * PAGESIZE
+ ***********************************************************************/
+EXTERN kpage_t* get_pages(int n);
+
+/***********************************************************************
+ *  Title: Releases a run of memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases a run of memory pages from get_pages (or a
+ *             single page from get_page)
+ *    Input: the pointer to the memory page structure
+ *    Output: none
+ ***********************************************************************/
+EXTERN void free_pages(kpage_t*);
+
 /***********************************************************************
  *  Title: Memory page statistics
  * ---------------------------------------------------------------------
@@ -126,6 +162,38 @@ EXTERN void free_page(kpage_t*);
  ***********************************************************************/
 EXTERN kpage_stat_t* page_stats();
 
+/***********************************************************************
+ *  Title: Page index
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the position of the page holding ptr within the
+ *             page pool
+ *    Input: any address inside a page handed out by get_page
+ *    Output: the page index, between 0 and POOLPAGES - 1
+ ***********************************************************************/
+EXTERN int page_index(void* ptr);
+
+/***********************************************************************
+ *  Title: Page descriptor
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the descriptor of the page holding ptr in constant
+ *             time, so the page doesn't have to store it
+ *    Input: any address inside a page handed out by get_page, or
+ *           inside a run from get_pages
+ *    Output: the descriptor get_page or get_pages returned
+ ***********************************************************************/
+EXTERN kpage_t* page_descriptor(void* ptr);
+
+/***********************************************************************
+ *  Title: Page pool backing
+ * ---------------------------------------------------------------------
+ *    Purpose: Tell which kind of memory backs the page pool; with
+ *             KPAGE_HUGE it falls back to small pages if no huge pages
+ *             are available
+ *    Input: none
+ *    Output: "small pages", "transparent huge pages" or "hugetlb pages"
+ ***********************************************************************/
+EXTERN char* page_backing();
+
 /************External Declaration*****************************************/
 
 /**************Definition***************************************************/